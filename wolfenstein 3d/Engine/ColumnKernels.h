@@ -0,0 +1,335 @@
+#pragma once
+#include <stdint.h>
+#include <immintrin.h>
+#include <SDL3/SDL.h>
+
+// msvc accepts any intrinsic in any function, gcc/clang need the isa on the function
+#if defined(_MSC_VER) && !defined(__clang__)
+	#define KERNEL_TARGET(isa)
+#else
+	#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace Engine
+{
+	#define KERNEL_MAX_SHIFT 8              // square power of two textures up to 256x256 get their own kernels
+	#define KERNEL_KEY_COLOR 0xFF00FF00     // pink, rgb part of the framebuffer pixel
+
+	// one textured screen column, texels are read straight from the stb layout
+	// (row major, r g b [a]) and written in the framebuffer RGBA8888 format
+	struct TextureColumn
+	{
+		uint32_t* dst;              // first pixel to write
+		int pitch;                  // framebuffer width in pixels
+		int count;                  // pixels to write going down
+
+		const uint8_t* texels;      // texture (mip level) data
+		int tex_w, tex_h;
+		int tex_x;                  // texture column
+		uint32_t v;                 // 16.16 texture row of the first pixel
+		uint32_t v_step;            // 16.16 texture rows per screen pixel
+
+		const uint8_t* ramp;        // colormap, ramp[c] == (c * scale) >> 8
+		uint16_t scale;
+
+		// masked kernels also write id to every pixel they draw, at the same pitch
+		uint32_t* id_dst;
+		uint32_t id;
+	};
+
+	typedef void (*ColumnKernel)(const TextureColumn& column);
+
+	enum class KernelIsa
+	{
+		Scalar,
+		SSE41,
+		AVX2,
+	};
+
+	// SHIFT < 0 is the generic kernel for any texture size
+	template <int SHIFT>
+	inline int TexelIndex(const TextureColumn& column, uint32_t v)
+	{
+		const int shift = SHIFT < 0 ? 0 : SHIFT;
+		if (SHIFT >= 0)
+			return ((((int)(v >> 16)) & ((1 << shift) - 1)) << shift) + column.tex_x;
+
+		int row = (int)(v >> 16);
+		row = row >= column.tex_h ? column.tex_h - 1 : row;
+		return row * column.tex_w + column.tex_x;
+	}
+
+	template <int SHIFT, int BPP, bool MASKED>
+	void DrawColumnScalar(const TextureColumn& column)
+	{
+		uint32_t* dst = column.dst;
+		uint32_t* id_dst = column.id_dst;
+		uint32_t v = column.v;
+
+		for (int i = 0; i < column.count; i++, dst += column.pitch, id_dst += MASKED ? column.pitch : 0, v += column.v_step)
+		{
+			const uint8_t* texel = column.texels + TexelIndex<SHIFT>(column, v) * BPP;
+			uint8_t r = texel[0];
+			uint8_t g = texel[1];
+			uint8_t b = texel[2];
+			uint8_t a = BPP == 4 ? texel[3] : 255;
+
+			if (MASKED && r == 255 && g == 0 && b == 255)
+				continue;
+
+			*dst = (column.ramp[r] << 24) | (column.ramp[g] << 16) | (column.ramp[b] << 8) | a;
+			if (MASKED)
+				*id_dst = column.id;
+		}
+	}
+
+	// 4 texels from 4 texel indices, as framebuffer pixels
+	template <int BPP>
+	KERNEL_TARGET("sse4.1") inline __m128i FetchTexels4(const uint8_t* texels, __m128i index)
+	{
+		const uint8_t* t0 = texels + _mm_cvtsi128_si32(index) * BPP;
+		const uint8_t* t1 = texels + _mm_extract_epi32(index, 1) * BPP;
+		const uint8_t* t2 = texels + _mm_extract_epi32(index, 2) * BPP;
+		const uint8_t* t3 = texels + _mm_extract_epi32(index, 3) * BPP;
+
+		// the mip chain keeps slack after every level so 3 byte texels can be loaded as 32 bits
+		__m128i raw = _mm_cvtsi32_si128(*(const int32_t*)t0);
+		raw = _mm_insert_epi32(raw, *(const int32_t*)t1, 1);
+		raw = _mm_insert_epi32(raw, *(const int32_t*)t2, 2);
+		raw = _mm_insert_epi32(raw, *(const int32_t*)t3, 3);
+		if (BPP == 3)
+			raw = _mm_or_si128(raw, _mm_set1_epi32((int)0xFF000000));
+
+		// r g b a in memory to r << 24 | g << 16 | b << 8 | a
+		const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+		return _mm_shuffle_epi8(raw, swap);
+	}
+
+	// scales the rgb bytes by scale / 256, alpha is kept
+	KERNEL_TARGET("sse4.1") inline __m128i ShadePixels4(__m128i pixels, __m128i scale)
+	{
+		__m128i lo = _mm_mullo_epi16(_mm_cvtepu8_epi16(pixels), scale);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, _mm_setzero_si128()), scale);
+		return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+	}
+
+	template <int SHIFT, int BPP, bool MASKED>
+	KERNEL_TARGET("sse4.1") void DrawColumnSSE41(const TextureColumn& column)
+	{
+		if (SHIFT < 0)
+			return DrawColumnScalar<SHIFT, BPP, MASKED>(column);
+
+		const int shift = SHIFT < 0 ? 0 : SHIFT;
+		uint32_t* dst = column.dst;
+		uint32_t* id_dst = column.id_dst;
+		const int pitch = column.pitch;
+
+		const __m128i row_mask = _mm_set1_epi32((1 << shift) - 1);
+		const __m128i tex_x = _mm_set1_epi32(column.tex_x);
+		const __m128i key = _mm_set1_epi32((int)KERNEL_KEY_COLOR);
+		const __m128i rgb_mask = _mm_set1_epi32((int)0xFFFFFF00);
+		const __m128i scale = _mm_set_epi16(column.scale, column.scale, column.scale, 256, column.scale, column.scale, column.scale, 256);
+		const __m128i v_step4 = _mm_set1_epi32((int)(column.v_step * 4));
+		__m128i v = _mm_add_epi32(_mm_set1_epi32((int)column.v), _mm_mullo_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32((int)column.v_step)));
+
+		int i = 0;
+		for (; i + 4 <= column.count; i += 4, dst += pitch * 4, id_dst += MASKED ? pitch * 4 : 0)
+		{
+			__m128i row = _mm_and_si128(_mm_srli_epi32(v, 16), row_mask);
+			__m128i index = _mm_add_epi32(_mm_slli_epi32(row, shift), tex_x);
+			v = _mm_add_epi32(v, v_step4);
+
+			__m128i pixels = FetchTexels4<BPP>(column.texels, index);
+			int store_mask = 0xF;
+			if (MASKED)
+				store_mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(pixels, rgb_mask), key))) & 0xF;
+			pixels = ShadePixels4(pixels, scale);
+
+			if (store_mask == 0xF)
+			{
+				dst[0] = (uint32_t)_mm_cvtsi128_si32(pixels);
+				dst[pitch] = (uint32_t)_mm_extract_epi32(pixels, 1);
+				dst[pitch * 2] = (uint32_t)_mm_extract_epi32(pixels, 2);
+				dst[pitch * 3] = (uint32_t)_mm_extract_epi32(pixels, 3);
+				if (MASKED)
+					for (int lane = 0; lane < 4; lane++)
+						id_dst[pitch * lane] = column.id;
+			}
+			else if (store_mask)
+			{
+				alignas(16) uint32_t lanes[4];
+				_mm_store_si128((__m128i*)lanes, pixels);
+				for (int lane = 0; lane < 4; lane++)
+				{
+					if (store_mask & (1 << lane))
+					{
+						dst[pitch * lane] = lanes[lane];
+						id_dst[pitch * lane] = column.id;
+					}
+				}
+			}
+		}
+
+		if (i < column.count)
+		{
+			TextureColumn tail = column;
+			tail.dst = dst;
+			tail.id_dst = id_dst;
+			tail.count = column.count - i;
+			tail.v = column.v + column.v_step * i;
+			DrawColumnScalar<SHIFT, BPP, MASKED>(tail);
+		}
+	}
+
+	template <int SHIFT, int BPP, bool MASKED>
+	KERNEL_TARGET("avx2") void DrawColumnAVX2(const TextureColumn& column)
+	{
+		if (SHIFT < 0)
+			return DrawColumnScalar<SHIFT, BPP, MASKED>(column);
+
+		const int shift = SHIFT < 0 ? 0 : SHIFT;
+		uint32_t* dst = column.dst;
+		uint32_t* id_dst = column.id_dst;
+		const int pitch = column.pitch;
+
+		const __m256i row_mask = _mm256_set1_epi32((1 << shift) - 1);
+		const __m256i tex_x = _mm256_set1_epi32(column.tex_x);
+		const __m256i key = _mm256_set1_epi32((int)KERNEL_KEY_COLOR);
+		const __m256i rgb_mask = _mm256_set1_epi32((int)0xFFFFFF00);
+		const __m256i opaque = _mm256_set1_epi32(BPP == 3 ? (int)0xFF000000 : 0);
+		const __m256i swap = _mm256_set_epi8(
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+		const __m256i scale = _mm256_set_epi16(
+			column.scale, column.scale, column.scale, 256, column.scale, column.scale, column.scale, 256,
+			column.scale, column.scale, column.scale, 256, column.scale, column.scale, column.scale, 256);
+		const __m256i v_step8 = _mm256_set1_epi32((int)(column.v_step * 8));
+		__m256i v = _mm256_add_epi32(_mm256_set1_epi32((int)column.v), _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32((int)column.v_step)));
+
+		int i = 0;
+		for (; i + 8 <= column.count; i += 8, dst += pitch * 8, id_dst += MASKED ? pitch * 8 : 0)
+		{
+			__m256i row = _mm256_and_si256(_mm256_srli_epi32(v, 16), row_mask);
+			__m256i index = _mm256_add_epi32(_mm256_slli_epi32(row, shift), tex_x);
+			v = _mm256_add_epi32(v, v_step8);
+
+			// byte offsets with scale 1 so 3 byte texels gather as well as 4 byte ones
+			__m256i offset = BPP == 4 ? _mm256_slli_epi32(index, 2) : _mm256_add_epi32(index, _mm256_slli_epi32(index, 1));
+			__m256i raw = _mm256_i32gather_epi32((const int*)column.texels, offset, 1);
+			__m256i pixels = _mm256_shuffle_epi8(_mm256_or_si256(raw, opaque), swap);
+
+			int store_mask = 0xFF;
+			if (MASKED)
+				store_mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(pixels, rgb_mask), key))) & 0xFF;
+
+			__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, _mm256_setzero_si256()), scale);
+			__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, _mm256_setzero_si256()), scale);
+			pixels = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+
+			alignas(32) uint32_t lanes[8];
+			_mm256_store_si256((__m256i*)lanes, pixels);
+			if (store_mask == 0xFF)
+			{
+				for (int lane = 0; lane < 8; lane++)
+					dst[pitch * lane] = lanes[lane];
+				if (MASKED)
+					for (int lane = 0; lane < 8; lane++)
+						id_dst[pitch * lane] = column.id;
+			}
+			else if (store_mask)
+			{
+				for (int lane = 0; lane < 8; lane++)
+				{
+					if (store_mask & (1 << lane))
+					{
+						dst[pitch * lane] = lanes[lane];
+						id_dst[pitch * lane] = column.id;
+					}
+				}
+			}
+		}
+
+		if (i < column.count)
+		{
+			TextureColumn tail = column;
+			tail.dst = dst;
+			tail.id_dst = id_dst;
+			tail.count = column.count - i;
+			tail.v = column.v + column.v_step * i;
+			DrawColumnSSE41<SHIFT, BPP, MASKED>(tail);
+		}
+	}
+
+	// every (texture size, bpp, masked) kernel for the isa picked at startup,
+	// so the inner loops carry no per pixel format or size branches
+	class ColumnKernels
+	{
+	private:
+		KernelIsa isa = KernelIsa::Scalar;
+		ColumnKernel table[KERNEL_MAX_SHIFT + 2][2][2] = {};
+
+		template <int SHIFT, int BPP, bool MASKED>
+		ColumnKernel Pick() const
+		{
+			switch (isa)
+			{
+			case KernelIsa::AVX2:
+				return &DrawColumnAVX2<SHIFT, BPP, MASKED>;
+			case KernelIsa::SSE41:
+				return &DrawColumnSSE41<SHIFT, BPP, MASKED>;
+			default:
+				return &DrawColumnScalar<SHIFT, BPP, MASKED>;
+			}
+		}
+
+		template <int SHIFT>
+		void FillShift()
+		{
+			table[SHIFT + 1][0][0] = Pick<SHIFT, 3, false>();
+			table[SHIFT + 1][0][1] = Pick<SHIFT, 3, true>();
+			table[SHIFT + 1][1][0] = Pick<SHIFT, 4, false>();
+			table[SHIFT + 1][1][1] = Pick<SHIFT, 4, true>();
+		}
+
+		template <int... SHIFTS>
+		void FillShifts()
+		{
+			int unused[] = { (FillShift<SHIFTS>(), 0)... };
+			(void)unused;
+		}
+
+	public:
+		// reads cpuid (through SDL) once, the best isa the cpu supports wins
+		void Init()
+		{
+			if (SDL_HasAVX2())
+				Init(KernelIsa::AVX2);
+			else if (SDL_HasSSE41())
+				Init(KernelIsa::SSE41);
+			else
+				Init(KernelIsa::Scalar);
+		}
+
+		// forces an isa, for comparing kernels against each other
+		void Init(KernelIsa forced_isa)
+		{
+			isa = forced_isa;
+			FillShifts<-1, 0, 1, 2, 3, 4, 5, 6, 7, 8>();
+		}
+
+		// bpp must be 3 or 4
+		ColumnKernel Get(int tex_w, int tex_h, int bpp, bool masked) const
+		{
+			int shift = -1;
+			if (tex_w == tex_h && (tex_w & (tex_w - 1)) == 0)
+			{
+				int size_shift = 0;
+				while ((1 << size_shift) < tex_w)
+					size_shift++;
+				if (size_shift <= KERNEL_MAX_SHIFT)
+					shift = size_shift;
+			}
+			return table[shift + 1][bpp == 4 ? 1 : 0][masked ? 1 : 0];
+		}
+	};
+}
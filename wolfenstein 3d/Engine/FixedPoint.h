@@ -0,0 +1,220 @@
+﻿#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+namespace Engine
+{
+	#define FRACBITS 16
+	#define FRACUNIT (1 << FRACBITS)
+	#define SLOPERANGE 2048
+
+	typedef int32_t fixed_t;
+
+	constexpr fixed_t IntToFixed(int v)
+	{
+		return v * FRACUNIT;
+	}
+
+	constexpr fixed_t DoubleToFixed(double v)
+	{
+		return (fixed_t)(v * FRACUNIT + (v >= 0.0 ? 0.5 : -0.5));
+	}
+
+	inline float FixedToFloat(fixed_t v)
+	{
+		return v / (float)FRACUNIT;
+	}
+
+	inline fixed_t FixedMul(fixed_t a, fixed_t b)
+	{
+		return (fixed_t)(((int64_t)a * b) >> FRACBITS);
+	}
+
+	// saturates instead of overflowing, like the original FixedDiv
+	inline fixed_t FixedDiv(fixed_t a, fixed_t b)
+	{
+		if ((llabs(a) >> 14) >= llabs(b))
+			return (a ^ b) < 0 ? INT32_MIN : INT32_MAX;
+		return (fixed_t)(((int64_t)a * FRACUNIT) / b);
+	}
+
+	// square root of a 32.32 value (the product of two fixed values) as 16.16
+	inline fixed_t FixedSqrt(int64_t v)
+	{
+		uint64_t value = (uint64_t)v;
+		uint64_t result = 0;
+		uint64_t bit = (uint64_t)1 << 62;
+
+		while (bit > value)
+			bit >>= 2;
+
+		while (bit != 0)
+		{
+			if (value >= result + bit)
+			{
+				value -= result + bit;
+				result = (result >> 1) + bit;
+			}
+			else
+			{
+				result >>= 1;
+			}
+			bit >>= 2;
+		}
+		return (fixed_t)result;
+	}
+
+	// 16.16 value type, lets the same casting code compile for float and fixed
+	struct Fixed
+	{
+		fixed_t raw = 0;
+
+		constexpr Fixed() = default;
+		explicit constexpr Fixed(int v) : raw(v * FRACUNIT) {}
+
+		static constexpr Fixed FromRaw(fixed_t v)
+		{
+			Fixed f;
+			f.raw = v;
+			return f;
+		}
+
+		Fixed operator+(Fixed o) const { return FromRaw(raw + o.raw); }
+		Fixed operator-(Fixed o) const { return FromRaw(raw - o.raw); }
+		Fixed operator*(Fixed o) const { return FromRaw(FixedMul(raw, o.raw)); }
+		Fixed operator/(Fixed o) const { return FromRaw(FixedDiv(raw, o.raw)); }
+		Fixed operator-() const { return FromRaw(-raw); }
+
+		Fixed& operator+=(Fixed o) { raw += o.raw; return *this; }
+		Fixed& operator-=(Fixed o) { raw -= o.raw; return *this; }
+
+		bool operator<(Fixed o) const { return raw < o.raw; }
+		bool operator>(Fixed o) const { return raw > o.raw; }
+		bool operator<=(Fixed o) const { return raw <= o.raw; }
+		bool operator>=(Fixed o) const { return raw >= o.raw; }
+		bool operator==(Fixed o) const { return raw == o.raw; }
+		bool operator!=(Fixed o) const { return raw != o.raw; }
+	};
+
+	inline float ToFloat(float v) { return v; }
+	inline float ToFloat(Fixed v) { return FixedToFloat(v.raw); }
+
+	inline int FloorToInt(float v) { return (int)floorf(v); }
+	inline int FloorToInt(Fixed v) { return v.raw >> FRACBITS; }
+
+	inline float Abs(float v) { return fabsf(v); }
+	inline Fixed Abs(Fixed v) { return Fixed::FromRaw(v.raw < 0 ? -v.raw : v.raw); }
+
+	inline float Sqrt(float v) { return sqrtf(v); }
+	inline Fixed Sqrt(Fixed v) { return Fixed::FromRaw(FixedSqrt((int64_t)v.raw << FRACBITS)); }
+
+	// bit pattern of the value, for hashing and sort keys
+	inline uint32_t RealBits(float v) { uint32_t bits; memcpy(&bits, &v, sizeof(bits)); return bits; }
+	inline uint32_t RealBits(Fixed v) { return (uint32_t)v.raw; }
+
+	// sine and arctangent tables over `fineangles` steps per turn, built by the
+	// compiler so every machine gets the exact same values
+	template <int fineangles>
+	struct FineTables
+	{
+		static_assert(fineangles % 8 == 0, "fine angles must split into octants");
+
+		fixed_t sine[fineangles + fineangles / 4];   // cosine(a) == sine[a + fineangles / 4]
+		int tantoangle[SLOPERANGE + 1];              // slope 0..1 in SLOPERANGE steps to fine angle 0..45 degrees
+
+		constexpr FineTables() : sine(), tantoangle()
+		{
+			const int quarter = fineangles / 4;
+			const double step = 2.0 * 3.14159265358979323846 / fineangles;
+
+			// first quarter from the taylor series, the rest by symmetry
+			for (int a = 0; a <= quarter; a++)
+			{
+				double x = a * step;
+				double term = x;
+				double sum = x;
+				for (int n = 1; n < 12; n++)
+				{
+					term *= -(x * x) / ((2 * n) * (2 * n + 1));
+					sum += term;
+				}
+				sine[a] = DoubleToFixed(sum);
+			}
+			for (int a = quarter + 1; a < 2 * quarter; a++)
+				sine[a] = sine[2 * quarter - a];
+			for (int a = 2 * quarter; a < 4 * quarter; a++)
+				sine[a] = -sine[a - 2 * quarter];
+			for (int a = 4 * quarter; a < 5 * quarter; a++)
+				sine[a] = sine[a - 4 * quarter];
+
+			// smallest angle whose tangent reaches each slope
+			for (int slope = 0; slope <= SLOPERANGE; slope++)
+			{
+				int low = 0;
+				int high = fineangles / 8;
+				while (low < high)
+				{
+					int middle = (low + high) / 2;
+					if ((int64_t)sine[middle] * SLOPERANGE >= (int64_t)slope * sine[middle + quarter])
+						high = middle;
+					else
+						low = middle + 1;
+				}
+				tantoangle[slope] = low;
+			}
+		}
+
+		fixed_t Sin(long long angle) const
+		{
+			return sine[Wrap(angle)];
+		}
+
+		fixed_t Cos(long long angle) const
+		{
+			return sine[Wrap(angle) + fineangles / 4];
+		}
+
+		static int Wrap(long long angle)
+		{
+			int a = (int)(angle % fineangles);
+			return a < 0 ? a + fineangles : a;
+		}
+
+		static int SlopeDiv(int64_t num, int64_t den)
+		{
+			if (den == 0)
+				return SLOPERANGE;
+			int64_t slope = (num * SLOPERANGE) / den;
+			return slope > SLOPERANGE ? SLOPERANGE : (int)slope;
+		}
+
+		// integer atan2, fine angle of the vector (dx, dy) in [0, fineangles)
+		int PointToAngle(fixed_t dx, fixed_t dy) const
+		{
+			const int quarter = fineangles / 4;
+			int64_t x = dx;
+			int64_t y = dy;
+
+			if (x == 0 && y == 0)
+				return 0;
+
+			if (x >= 0)
+			{
+				if (y >= 0)
+					return x > y ? tantoangle[SlopeDiv(y, x)] : quarter - tantoangle[SlopeDiv(x, y)];
+
+				y = -y;
+				return x > y ? Wrap(4 * quarter - tantoangle[SlopeDiv(y, x)]) : 3 * quarter + tantoangle[SlopeDiv(x, y)];
+			}
+
+			x = -x;
+			if (y >= 0)
+				return x > y ? 2 * quarter - tantoangle[SlopeDiv(y, x)] : quarter + tantoangle[SlopeDiv(x, y)];
+
+			y = -y;
+			return x > y ? 2 * quarter + tantoangle[SlopeDiv(y, x)] : 3 * quarter - tantoangle[SlopeDiv(x, y)];
+		}
+	};
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <iostream>
+
+namespace Engine
+{
+	#define FRAME_ARENA_ALIGNMENT 64   // every allocation starts on its own cache line
+
+	// linear allocator for data that lives for one frame, allocating is an
+	// atomic pointer bump so jobs on worker threads can allocate too, and
+	// everything is released at once by Reset()
+	class FrameArena
+	{
+	private:
+		uint8_t* block = nullptr;
+		uint8_t* memory = nullptr;
+		size_t capacity = 0;
+		std::atomic<size_t> offset{ 0 };
+
+	public:
+		FrameArena(size_t capacity)
+		{
+			this->capacity = capacity;
+			block = new uint8_t[capacity + FRAME_ARENA_ALIGNMENT];
+			memory = (uint8_t*)(((uintptr_t)block + FRAME_ARENA_ALIGNMENT - 1) & ~(uintptr_t)(FRAME_ARENA_ALIGNMENT - 1));
+		}
+
+		// uninitialized storage for count values of T, safe to call from any thread
+		template <typename T>
+		T* Alloc(size_t count)
+		{
+			size_t size = (sizeof(T) * count + FRAME_ARENA_ALIGNMENT - 1) & ~(size_t)(FRAME_ARENA_ALIGNMENT - 1);
+			size_t start = offset.fetch_add(size, std::memory_order_relaxed);
+			if (start + size > capacity)
+			{
+				std::cout << "Frame Arena Out Of Memory!\n";
+				__debugbreak();
+			}
+			return (T*)(memory + start);
+		}
+
+		// only while no job is allocating, the main loop calls it at the start of a frame
+		void Reset()
+		{
+			offset.store(0, std::memory_order_relaxed);
+		}
+
+		void Destroy()
+		{
+			delete[] block;
+			block = memory = nullptr;
+			capacity = 0;
+			offset = 0;
+		}
+	};
+}
@@ -0,0 +1,176 @@
+﻿#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+namespace Engine
+{
+	// small fork/join pool, the calling thread splits a range into batches
+	// and works on them together with the workers until all are done
+	class JobSystem
+	{
+	private:
+		// the callable stays on the caller's stack while the job runs, so it is
+		// passed as a pointer to it and a function that knows its type, never copied
+		using RangeJob = void (*)(const void* context, int begin, int end);
+
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable wake_workers;
+		std::condition_variable job_done;
+		bool shutting_down = false;
+
+		// current job, only changed under the mutex while no worker is inside it
+		uint64_t generation = 0;
+		RangeJob job = nullptr;
+		const void* job_context = nullptr;
+		int job_count = 0;
+		int job_batch_size = 1;
+		int job_batch_count = 0;
+		int active_workers = 0;
+
+		std::atomic<int> next_batch{ 0 };
+		std::atomic<int> batches_left{ 0 };
+
+		static bool& IsInsideJob()
+		{
+			static thread_local bool inside_job = false;
+			return inside_job;
+		}
+
+		template <typename F>
+		static void InvokeRange(const void* context, int begin, int end)
+		{
+			(*(const F*)context)(begin, end);
+		}
+
+		void RunBatches(RangeJob func, const void* context, int count, int batch_size, int batch_count)
+		{
+			IsInsideJob() = true;
+			for (;;)
+			{
+				int batch = next_batch.fetch_add(1);
+				if (batch >= batch_count)
+					break;
+
+				int begin = batch * batch_size;
+				int end = begin + batch_size > count ? count : begin + batch_size;
+				func(context, begin, end);
+
+				if (batches_left.fetch_sub(1) == 1)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					job_done.notify_all();
+				}
+			}
+			IsInsideJob() = false;
+		}
+
+		void WorkerLoop()
+		{
+			uint64_t seen_generation = 0;
+			for (;;)
+			{
+				RangeJob func;
+				const void* context;
+				int count, batch_size, batch_count;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake_workers.wait(lock, [&] { return shutting_down || generation != seen_generation; });
+					if (shutting_down)
+						return;
+
+					seen_generation = generation;
+					func = job;
+					context = job_context;
+					count = job_count;
+					batch_size = job_batch_size;
+					batch_count = job_batch_count;
+					active_workers++;
+				}
+
+				RunBatches(func, context, count, batch_size, batch_count);
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					active_workers--;
+				}
+				job_done.notify_all();
+			}
+		}
+
+	public:
+		// worker_count < 0 picks one worker per extra hardware thread
+		JobSystem(int worker_count = -1)
+		{
+			if (worker_count < 0)
+			{
+				int hardware_threads = (int)std::thread::hardware_concurrency();
+				worker_count = hardware_threads > 1 ? hardware_threads - 1 : 0;
+			}
+
+			for (int i = 0; i < worker_count; i++)
+				workers.emplace_back([this] { WorkerLoop(); });
+		}
+
+		// calls func(begin, end) over [0, count) in batches of batch_size and
+		// returns once every batch finished, nested calls run on the caller
+		template <typename F>
+		void ParallelFor(int count, int batch_size, const F& func)
+		{
+			if (count <= 0)
+				return;
+
+			if (batch_size < 1)
+				batch_size = 1;
+
+			if (workers.empty() || IsInsideJob() || count <= batch_size)
+			{
+				func(0, count);
+				return;
+			}
+
+			Run(&InvokeRange<F>, &func, count, batch_size);
+		}
+
+		void Destroy()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				shutting_down = true;
+			}
+			wake_workers.notify_all();
+
+			for (auto& worker : workers)
+				worker.join();
+			workers.clear();
+		}
+
+	private:
+		void Run(RangeJob func, const void* context, int count, int batch_size)
+		{
+			int batch_count = (count + batch_size - 1) / batch_size;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				job_done.wait(lock, [&] { return active_workers == 0; });
+
+				job = func;
+				job_context = context;
+				job_count = count;
+				job_batch_size = batch_size;
+				job_batch_count = batch_count;
+				next_batch = 0;
+				batches_left = batch_count;
+				generation++;
+			}
+			wake_workers.notify_all();
+
+			RunBatches(func, context, count, batch_size, batch_count);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			job_done.wait(lock, [&] { return batches_left == 0; });
+		}
+	};
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+namespace Engine
+{
+	// bounded queue any number of threads push to without a lock and one
+	// thread pops from. every slot has a sequence number, a producer claims a
+	// slot by bumping head and publishes it by storing the sequence, so the
+	// consumer never reads a slot whose value is still being written
+	template <typename T, int CAPACITY>
+	class MpscRing
+	{
+		static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of two");
+
+	private:
+		struct Slot
+		{
+			std::atomic<uint32_t> sequence;    // position it takes next, position + 1 once written
+			T value;
+		};
+
+		Slot slots[CAPACITY];
+		alignas(64) std::atomic<uint32_t> head{ 0 };    // next position producers claim
+		alignas(64) uint32_t tail = 0;                  // next position the consumer reads
+
+	public:
+		MpscRing()
+		{
+			for (int i = 0; i < CAPACITY; i++)
+				slots[i].sequence.store((uint32_t)i, std::memory_order_relaxed);
+		}
+
+		// safe from any thread, false when the ring is full and the value was dropped
+		bool Push(const T& value)
+		{
+			uint32_t position = head.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				Slot& slot = slots[position & (CAPACITY - 1)];
+				int32_t lag = (int32_t)(slot.sequence.load(std::memory_order_acquire) - position);
+				if (lag == 0)
+				{
+					if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						slot.value = value;
+						slot.sequence.store(position + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (lag < 0)
+				{
+					// the consumer hasn't read this slot from the last lap yet
+					return false;
+				}
+				else
+				{
+					position = head.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// consumer thread only, false when nothing is ready
+		bool Pop(T& value)
+		{
+			Slot& slot = slots[tail & (CAPACITY - 1)];
+			if ((int32_t)(slot.sequence.load(std::memory_order_acquire) - (tail + 1)) < 0)
+				return false;
+
+			value = slot.value;
+			slot.sequence.store(tail + CAPACITY, std::memory_order_release);
+			tail++;
+			return true;
+		}
+	};
+}
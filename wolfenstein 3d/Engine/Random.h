@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+
+namespace Engine
+{
+	// small seeded generator (xorshift32) the game owns, unlike rand() its
+	// sequence doesn't depend on the CRT or on what else called it, so a
+	// simulation that only draws from its own one replays the same
+	class Random
+	{
+	private:
+		uint32_t state;
+
+	public:
+		explicit Random(uint32_t seed)
+		{
+			Seed(seed);
+		}
+
+		// 0 would stay 0 forever
+		void Seed(uint32_t seed)
+		{
+			state = seed != 0 ? seed : 0x9E3779B9u;
+		}
+
+		uint32_t Next()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+		// uniform enough in [0, n) for the small n the game asks for
+		int Below(int n)
+		{
+			return (int)(Next() % (uint32_t)n);
+		}
+	};
+}
@@ -1,10 +1,20 @@
 ﻿#include <iostream>
 #include "Engine/Graphics.h"
+#include "Engine/JobSystem.h"
+#include "Engine/FixedPoint.h"
+#include "Engine/ColumnKernels.h"
+#include "Engine/FrameArena.h"
+#include "Engine/MpscRing.h"
+#include "Engine/Random.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "Engine/stb_image.h"
 #include <Windows.h>
 #include <math.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <functional>
 
 #pragma comment(lib, "winmm.lib")
 
@@ -23,6 +33,7 @@ using namespace Engine;
 
 #define COL_TILE_NUM 20
 #define RAW_TILE_NUM 13
+#define MAP_TILE_COUNT (RAW_TILE_NUM * COL_TILE_NUM)
 
 #define WINDOW_WIDTH (COL_TILE_NUM * TILE_SIZE)
 #define WINDOW_HEIGHT (RAW_TILE_NUM * TILE_SIZE)
@@ -35,6 +46,88 @@ float FOV_ANGLE = 60.0f * TORAD;
 
 #define MAP_SCALING_FACTOR 0.3f
 
+// 1 = casting, movement and projection run in 16.16 fixed point on fixed
+// rate tics, bit exact on every machine and compiler like the original
+#define FIXED_POINT_MODE 0
+
+#define FINEANGLES (NUM_RAYS * 6)   // one fine angle per column over the 60 degree fov
+#define TICRATE 70
+#define MAX_TICS_PER_FRAME 8        // a longer hitch drops the rest instead of catching up
+#define GAME_RANDOM_SEED 0x2545F491u
+
+#define FRAME_ARENA_SIZE (4 * 1024 * 1024)
+
+/////////////////////////////////////////////////////////////
+
+
+
+
+///////////////////////// FIXED POINT ///////////////////////////
+
+
+#if FIXED_POINT_MODE
+typedef Fixed Real;
+#define REAL_FAR Fixed(8192)   // past any distance in the map, two of them still fit in 16.16
+
+constexpr FineTables<FINEANGLES> FineTrig;
+#else
+typedef float Real;
+#define REAL_FAR INFINITY
+#endif
+
+// distance to the projection plane, (WINDOW_WIDTH / 2) / tan(30 degrees)
+constexpr fixed_t DISTANCE_PROJ_PLANE_FIXED = DoubleToFixed((WINDOW_WIDTH / 2) * 1.7320508075688772);
+
+// angles are counted in fine angles, one per column step
+inline Real AngleCos(long long angle)
+{
+#if FIXED_POINT_MODE
+	return Fixed::FromRaw(FineTrig.Cos(angle));
+#else
+	return cosf(angle * (FOV_ANGLE / NUM_RAYS));
+#endif
+}
+
+inline Real AngleSin(long long angle)
+{
+#if FIXED_POINT_MODE
+	return Fixed::FromRaw(FineTrig.Sin(angle));
+#else
+	return sinf(angle * (FOV_ANGLE / NUM_RAYS));
+#endif
+}
+
+// projected height of a tile at the given perpendicular distance
+inline int ProjectTileHeight(float corrected_distance)
+{
+	float distance_proj_plane = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
+	return (int)((TILE_SIZE / corrected_distance) * distance_proj_plane);
+}
+
+inline int ProjectTileHeight(Fixed corrected_distance)
+{
+	const int64_t max_height = 1 << 24;
+	if (corrected_distance.raw <= 0)
+		return (int)max_height;
+
+	int64_t height = ((int64_t)TILE_SIZE * DISTANCE_PROJ_PLANE_FIXED) / corrected_distance.raw;
+	return (int)(height > max_height ? max_height : height);
+}
+
+// compile time constants in either mode
+inline Real ToReal(double v)
+{
+#if FIXED_POINT_MODE
+	return Fixed::FromRaw(DoubleToFixed(v));
+#else
+	return (float)v;
+#endif
+}
+
+// every random choice the simulation makes, effects that only show (particles)
+// use rand() so they can't shift the sequence
+Random GameRandom(GAME_RANDOM_SEED);
+
 /////////////////////////////////////////////////////////////
 
 
@@ -45,23 +138,586 @@ float FOV_ANGLE = 60.0f * TORAD;
 
 
 
-const int map[RAW_TILE_NUM][COL_TILE_NUM] =
+// changed at runtime through SetTile() only, which keeps everything built from it up to date
+int map[RAW_TILE_NUM][COL_TILE_NUM] =
 {
 	{1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
 	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
 	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
-	{1, 1, 1, 1, 0, 0, 0, 2, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
+	{1, 1, 1, 1, 0, 0, 0, 2, 8, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
 	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, 1},
-	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 0, 4, 0, 0, 1, 0, 0, 1},
+	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 0, 4, 0, 0, 9, 0, 0, 1},
 	{1, 0, 0, 6, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1},
-	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1},
-	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 1},
+	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0, 1},
+	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 9, 1, 1, 0, 0, 1},
 	{1, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
-	{1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
+	{1, 8, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
 	{1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
 	{1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}
 };
 
+uint32_t TileEdits = 0;    // bumped by SetTile(), cached rays are stale then
+
+#define DOOR_TILE 8                    // map value of a sliding door
+#define DOOR_TEXTURE 7
+#define MAX_DOORS 64
+#define NO_DOOR 0xFF
+#define DOOR_SPEED ToReal(1.0)         // open fraction per second
+#define DOOR_HOLD_TIME ToReal(3.0)     // seconds a door stays open
+
+#define GRATE_TILE 9                   // map value of a see-through grate, also its texture index
+
+#define TORCH_TEXTURE 10               // animated, has no still image of its own
+#define WALL_TEXTURE_COUNT 11          // texture ids, the first ones are the map values
+#define GRATE_BAR_SPACING 16           // texels from one bar to the next
+#define GRATE_BAR_WIDTH 4
+
+// grate bars run the full height of the texture, a ray that hits one stops
+// there like on a wall, between them it sees through the grate
+inline bool IsGrateBar(int u)
+{
+	return u % GRATE_BAR_SPACING < GRATE_BAR_WIDTH;
+}
+
+// one bit per map tile, tiles are numbered raw * COL_TILE_NUM + col
+struct TileSet
+{
+	uint64_t bits[(MAP_TILE_COUNT + 63) / 64];
+
+	void Clear()
+	{
+		memset(bits, 0, sizeof(bits));
+	}
+
+	void Set(int tile)
+	{
+		bits[tile >> 6] |= (uint64_t)1 << (tile & 63);
+	}
+
+	void Unset(int tile)
+	{
+		bits[tile >> 6] &= ~((uint64_t)1 << (tile & 63));
+	}
+
+	bool Has(int tile) const
+	{
+		return (bits[tile >> 6] >> (tile & 63)) & 1;
+	}
+
+	// sets every tile the triangle touches, each tile row takes the columns
+	// from the leftmost to the rightmost point of the triangle inside that row
+	void FillTriangle(float ax, float ay, float bx, float by, float cx, float cy)
+	{
+		const float px[3] = { ax, bx, cx };
+		const float py[3] = { ay, by, cy };
+
+		int first_raw = (int)floorf(fminf(ay, fminf(by, cy)) / TILE_SIZE);
+		int last_raw = (int)floorf(fmaxf(ay, fmaxf(by, cy)) / TILE_SIZE);
+		first_raw = first_raw < 0 ? 0 : first_raw;
+		last_raw = last_raw >= RAW_TILE_NUM ? RAW_TILE_NUM - 1 : last_raw;
+
+		for (int raw = first_raw; raw <= last_raw; raw++)
+		{
+			float top = (float)(raw * TILE_SIZE);
+			float bottom = top + TILE_SIZE;
+			float left = INFINITY;
+			float right = -INFINITY;
+
+			// the part of every edge inside the row
+			for (int p = 0; p < 3; p++)
+			{
+				int q = p == 2 ? 0 : p + 1;
+				float low = fmaxf(top, fminf(py[p], py[q]));
+				float high = fminf(bottom, fmaxf(py[p], py[q]));
+				if (low > high)
+					continue;
+
+				float x_low = px[p];
+				float x_high = px[q];
+				if (py[p] != py[q])
+				{
+					float slope = (px[q] - px[p]) / (py[q] - py[p]);
+					x_low = px[p] + (low - py[p]) * slope;
+					x_high = px[p] + (high - py[p]) * slope;
+				}
+				left = fminf(left, fminf(x_low, x_high));
+				right = fmaxf(right, fmaxf(x_low, x_high));
+			}
+
+			if (left > right)
+				continue;
+
+			int first_col = (int)floorf(left / TILE_SIZE);
+			int last_col = (int)floorf(right / TILE_SIZE);
+			first_col = first_col < 0 ? 0 : first_col;
+			last_col = last_col >= COL_TILE_NUM ? COL_TILE_NUM - 1 : last_col;
+			for (int col = first_col; col <= last_col; col++)
+				Set(raw * COL_TILE_NUM + col);
+		}
+	}
+};
+
+enum TileFlags : uint8_t
+{
+	TILE_WALL = 1 << 0,     // blocks rays and movement for good, grates too
+	TILE_DOOR = 1 << 1,
+	TILE_GRATE = 1 << 2,    // rays go on through the gaps between the bars
+};
+
+// the four faces of a tile by the direction they look at
+enum TileFace : uint8_t
+{
+	TILE_FACE_WEST,
+	TILE_FACE_EAST,
+	TILE_FACE_NORTH,
+	TILE_FACE_SOUTH,
+};
+
+// what the caster and the movers need to know about a tile, eight to a cache line
+struct TileInfo
+{
+	uint8_t texture[4];    // by TileFace
+	uint8_t flags;
+	uint8_t door;          // index into Doors, NO_DOOR when the tile has none
+	uint8_t unused[2];
+};
+
+// a wall face that doesn't use the texture of its map value
+struct FaceTexture
+{
+	uint8_t raw, col;
+	uint8_t face;       // TileFace
+	uint8_t texture;
+};
+
+const FaceTexture face_textures[] =
+{
+	{ 5, 11, TILE_FACE_SOUTH, 4 },
+	{ 5, 11, TILE_FACE_NORTH, 4 },
+	{ 6, 3, TILE_FACE_EAST, TORCH_TEXTURE },
+	{ 6, 5, TILE_FACE_WEST, TORCH_TEXTURE },
+	{ 9, 6, TILE_FACE_NORTH, TORCH_TEXTURE },
+	{ 9, 7, TILE_FACE_NORTH, TORCH_TEXTURE },
+	{ 8, 13, TILE_FACE_SOUTH, 2 },
+};
+
+// compact copy of the map for the hot loops, one bit per tile says whether a
+// ray has to stop and look at it and one whether it is a wall, the bitmaps
+// of a map many times this size still fit in L2. the rest of a tile is in
+// its TileInfo
+struct TileTable
+{
+	TileSet filled;    // anything but empty floor
+	TileSet walls;
+	alignas(64) TileInfo info[MAP_TILE_COUNT];
+
+	void Build()
+	{
+		filled.Clear();
+		walls.Clear();
+		for (int r = 0; r < RAW_TILE_NUM; r++)
+		{
+			for (int c = 0; c < COL_TILE_NUM; c++)
+			{
+				info[r * COL_TILE_NUM + c].door = NO_DOOR;
+				TileChanged(r, c);
+			}
+		}
+	}
+
+	// takes the tile from the map again, the door index is left to the doors
+	void TileChanged(int r, int c)
+	{
+		int tile = r * COL_TILE_NUM + c;
+		int value = map[r][c];
+		TileInfo& tile_info = info[tile];
+
+		tile_info.flags = 0;
+		if (value == DOOR_TILE)
+			tile_info.flags = TILE_DOOR;
+		else if (value == GRATE_TILE)
+			tile_info.flags = TILE_WALL | TILE_GRATE;
+		else if (value != 0)
+			tile_info.flags = TILE_WALL;
+
+		uint8_t texture = (uint8_t)(value == DOOR_TILE ? DOOR_TEXTURE : value);
+		memset(tile_info.texture, texture, sizeof(tile_info.texture));
+
+		// faces the level gives their own texture, as long as the tile is a plain wall
+		if (tile_info.flags == TILE_WALL)
+		{
+			for (const FaceTexture& face : face_textures)
+			{
+				if (face.raw == r && face.col == c)
+					tile_info.texture[face.face] = face.texture;
+			}
+		}
+
+		if (value != 0)
+			filled.Set(tile);
+		else
+			filled.Unset(tile);
+
+		if (tile_info.flags & TILE_WALL)
+			walls.Set(tile);
+		else
+			walls.Unset(tile);
+	}
+
+	bool IsFilled(int r, int c) const
+	{
+		return filled.Has(r * COL_TILE_NUM + c);
+	}
+
+	const TileInfo& At(int r, int c) const
+	{
+		return info[r * COL_TILE_NUM + c];
+	}
+};
+TileTable Tiles;
+
+// walls only, tiles outside the map count as walls, doors are left out
+// since they open, so paths and the pvs go through them
+inline bool IsWallTile(int raw, int col)
+{
+	if (raw < 0 || col < 0 || raw >= RAW_TILE_NUM || col >= COL_TILE_NUM)
+		return true;
+	return Tiles.walls.Has(raw * COL_TILE_NUM + col);
+}
+
+enum DoorState : uint8_t
+{
+	DOOR_CLOSED,
+	DOOR_OPENING,
+	DOOR_OPEN,
+	DOOR_CLOSING,
+};
+
+// doors are thin walls across the middle of their tile that slide sideways
+// into the wall, the map only says where they are and everything that
+// changes lives in these arrays indexed by door
+struct DoorSet
+{
+	int count = 0;                 // the door of a tile is in its TileInfo
+
+	uint8_t raw[MAX_DOORS];
+	uint8_t col[MAX_DOORS];
+	bool vertical[MAX_DOORS];      // plane at x = middle of the tile, walls above and below
+	DoorState state[MAX_DOORS];
+	Real open[MAX_DOORS];          // slid away part, 0 closed .. 1 open
+	Real hold[MAX_DOORS];          // time left before an open door closes
+
+	uint32_t changes = 0;          // bumped whenever a door moved, cached rays are stale then
+
+	void Init()
+	{
+		count = 0;
+		for (int r = 0; r < RAW_TILE_NUM; r++)
+		{
+			for (int c = 0; c < COL_TILE_NUM; c++)
+			{
+				Tiles.info[r * COL_TILE_NUM + c].door = NO_DOOR;
+				if (Tiles.At(r, c).flags & TILE_DOOR)
+					Add(r, c);
+			}
+		}
+	}
+
+	void Add(int r, int c)
+	{
+		if (count >= MAX_DOORS)
+		{
+			std::cout << "Too Many Doors!\n";
+			__debugbreak();
+		}
+
+		int d = count++;
+		Tiles.info[r * COL_TILE_NUM + c].door = (uint8_t)d;
+		raw[d] = (uint8_t)r;
+		col[d] = (uint8_t)c;
+		vertical[d] = IsWallTile(r - 1, c) && IsWallTile(r + 1, c);
+		state[d] = DOOR_CLOSED;
+		open[d] = Real(0);
+		hold[d] = Real(0);
+	}
+
+	// keeps the doors in step with an edited tile, the last door takes the
+	// index of a removed one
+	void TileChanged(int r, int c)
+	{
+		int d = At(r, c);
+		bool is_door = (Tiles.At(r, c).flags & TILE_DOOR) != 0;
+		if (d != -1 && !is_door)
+		{
+			int last = --count;
+			Tiles.info[r * COL_TILE_NUM + c].door = NO_DOOR;
+			if (d != last)
+			{
+				raw[d] = raw[last];
+				col[d] = col[last];
+				vertical[d] = vertical[last];
+				state[d] = state[last];
+				open[d] = open[last];
+				hold[d] = hold[last];
+				Tiles.info[raw[d] * COL_TILE_NUM + col[d]].door = (uint8_t)d;
+			}
+		}
+		else if (d == -1 && is_door)
+		{
+			Add(r, c);
+		}
+
+		// doors next to the tile may slide the other way now
+		static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+		for (int n = 0; n < 4; n++)
+		{
+			int next = At(r + offsets[n][0], c + offsets[n][1]);
+			if (next != -1)
+				vertical[next] = IsWallTile(raw[next] - 1, col[next]) && IsWallTile(raw[next] + 1, col[next]);
+		}
+	}
+
+	// door index, -1 when the tile has none
+	int At(int r, int c) const
+	{
+		if (r < 0 || c < 0 || r >= RAW_TILE_NUM || c >= COL_TILE_NUM)
+			return -1;
+		int door = Tiles.At(r, c).door;
+		return door == NO_DOOR ? -1 : door;
+	}
+
+	// opening an open door keeps it open longer
+	void Open(int d)
+	{
+		if (state[d] == DOOR_OPEN)
+			hold[d] = DOOR_HOLD_TIME;
+		else if (state[d] != DOOR_OPENING)
+			state[d] = DOOR_OPENING;
+	}
+
+	// occupied doors wait before closing, and one closing on something opens again
+	void Update(Real dt, const bool* occupied)
+	{
+		Real step = DOOR_SPEED * dt;
+		for (int d = 0; d < count; d++)
+		{
+			switch (state[d])
+			{
+			case DOOR_OPENING:
+				open[d] += step;
+				if (!(open[d] < Real(1)))
+				{
+					open[d] = Real(1);
+					state[d] = DOOR_OPEN;
+					hold[d] = DOOR_HOLD_TIME;
+				}
+				changes++;
+				break;
+			case DOOR_OPEN:
+				hold[d] -= dt;
+				if (!(Real(0) < hold[d]) && !occupied[d])
+					state[d] = DOOR_CLOSING;
+				break;
+			case DOOR_CLOSING:
+				if (occupied[d])
+				{
+					state[d] = DOOR_OPENING;
+					break;
+				}
+				open[d] -= step;
+				if (!(Real(0) < open[d]))
+				{
+					open[d] = Real(0);
+					state[d] = DOOR_CLOSED;
+				}
+				changes++;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+};
+DoorSet Doors;
+
+// blocks movement and sight right now, walls and doors that are not fully open
+inline bool IsSolidTile(int raw, int col)
+{
+	if (IsWallTile(raw, col))
+		return true;
+	int door = Doors.At(raw, col);
+	return door != -1 && Doors.state[door] != DOOR_OPEN;
+}
+
+#define CLEARANCE_MAX 255    // open space past this many tiles reads as this many
+
+// chebyshev distance in tiles from every tile to the nearest tile that is not
+// empty, a ray in a tile of clearance k crosses k - 1 rings of empty tiles
+// around it before it can hit anything. outside the map counts as solid
+struct ClearanceField
+{
+	uint8_t distance[RAW_TILE_NUM][COL_TILE_NUM];
+
+	void Build()
+	{
+		Recompute(0, 0, RAW_TILE_NUM - 1, COL_TILE_NUM - 1);
+	}
+
+	int At(int r, int c) const
+	{
+		if (r < 0 || c < 0 || r >= RAW_TILE_NUM || c >= COL_TILE_NUM)
+			return 0;
+		return distance[r][c];
+	}
+
+	// only the square around the tile that the edit can reach gets redone,
+	// ring r of it changes when a filled tile is closer than what ring r had
+	// or an emptied one was the nearest, the first ring without such a tile
+	// keeps every ring past it as it was
+	void TileChanged(int r, int c)
+	{
+		bool filled = Tiles.IsFilled(r, c);
+		int radius = 0;
+		for (int ring = 1; ring < CLEARANCE_MAX && RingChanges(r, c, ring, filled); ring++)
+			radius = ring;
+
+		Recompute(r - radius, c - radius, r + radius, c + radius);
+	}
+
+	bool RingChanges(int r, int c, int ring, bool filled) const
+	{
+		for (int y = r - ring; y <= r + ring; y++)
+		{
+			// the top and bottom rows whole, the rows between only at both ends
+			int step = y == r - ring || y == r + ring ? 1 : 2 * ring;
+			for (int x = c - ring; x <= c + ring; x += step)
+			{
+				if (y < 0 || x < 0 || y >= RAW_TILE_NUM || x >= COL_TILE_NUM)
+					continue;
+				if (filled ? distance[y][x] > ring : distance[y][x] == ring)
+					return true;
+			}
+		}
+		return false;
+	}
+
+	// two pass chessboard transform over the rectangle, tiles around it are
+	// read as they are
+	void Recompute(int r0, int c0, int r1, int c1)
+	{
+		r0 = r0 < 0 ? 0 : r0;
+		c0 = c0 < 0 ? 0 : c0;
+		r1 = r1 >= RAW_TILE_NUM ? RAW_TILE_NUM - 1 : r1;
+		c1 = c1 >= COL_TILE_NUM ? COL_TILE_NUM - 1 : c1;
+
+		for (int r = r0; r <= r1; r++)
+			for (int c = c0; c <= c1; c++)
+				distance[r][c] = Tiles.IsFilled(r, c) ? 0 : CLEARANCE_MAX;
+
+		for (int r = r0; r <= r1; r++)
+		{
+			for (int c = c0; c <= c1; c++)
+			{
+				int d = distance[r][c];
+				d = Min(d, At(r - 1, c - 1) + 1);
+				d = Min(d, At(r - 1, c) + 1);
+				d = Min(d, At(r - 1, c + 1) + 1);
+				d = Min(d, At(r, c - 1) + 1);
+				distance[r][c] = (uint8_t)d;
+			}
+		}
+		for (int r = r1; r >= r0; r--)
+		{
+			for (int c = c1; c >= c0; c--)
+			{
+				int d = distance[r][c];
+				d = Min(d, At(r + 1, c + 1) + 1);
+				d = Min(d, At(r + 1, c) + 1);
+				d = Min(d, At(r + 1, c - 1) + 1);
+				d = Min(d, At(r, c + 1) + 1);
+				distance[r][c] = (uint8_t)d;
+			}
+		}
+	}
+
+	static int Min(int a, int b)
+	{
+		return a < b ? a : b;
+	}
+};
+ClearanceField Clearance;
+
+// where a circle at (along, across) ends up when it moves by delta along one
+// axis, vertical makes y the moving axis, every tile between the start and
+// the end is checked so fast movers cannot tunnel, and the distance to tile
+// corners is exact so circles round corners instead of catching on them
+inline Real ClipCircleMove(Real along, Real across, Real delta, Real radius, bool vertical)
+{
+	Real target = along + delta;
+	if (delta == Real(0))
+		return target;
+
+	bool forward = Real(0) < delta;
+	int step = forward ? 1 : -1;
+	int first = FloorToInt(along) / TILE_SIZE + step;
+	int last = FloorToInt(forward ? target + radius : target - radius) / TILE_SIZE;
+	int across_first = FloorToInt(across - radius) / TILE_SIZE;
+	int across_last = FloorToInt(across + radius) / TILE_SIZE;
+
+	for (int t = first; (t - last) * step <= 0; t += step)
+	{
+		Real face = Real(forward ? t * TILE_SIZE : (t + 1) * TILE_SIZE);
+		bool blocked = false;
+
+		for (int a = across_first; a <= across_last; a++)
+		{
+			if (!(vertical ? IsSolidTile(t, a) : IsSolidTile(a, t)))
+				continue;
+
+			Real low = Real(a * TILE_SIZE);
+			Real high = Real((a + 1) * TILE_SIZE);
+			Real gap = across < low ? low - across : (high < across ? across - high : Real(0));
+			if (!(gap < radius))
+				continue;
+
+			// never pushed back out of a wall it already overlaps, it just cannot go further in
+			Real reach = Sqrt(radius * radius - gap * gap);
+			Real limit = forward ? face - reach : face + reach;
+			if (forward)
+			{
+				limit = limit < along ? along : limit;
+				target = limit < target ? limit : target;
+			}
+			else
+			{
+				limit = along < limit ? along : limit;
+				target = target < limit ? limit : target;
+			}
+			blocked = true;
+		}
+
+		// tiles further along can only stop the circle later
+		if (blocked)
+			break;
+	}
+	return target;
+}
+
+// moves a circle by (move_x, move_y) one axis at a time, so a blocked axis
+// stops at the wall while the other keeps going and movers slide along walls
+inline void SlideCircle(Real& x, Real& y, Real move_x, Real move_y, Real radius)
+{
+	x = ClipCircleMove(x, y, move_x, radius, false);
+	y = ClipCircleMove(y, x, move_y, radius, true);
+}
+
+// the same over a batch of movers, straight on their SoA position arrays
+void SlideCircles(Real* x, Real* y, const Real* move_x, const Real* move_y, int count, Real radius)
+{
+	for (int i = 0; i < count; i++)
+		SlideCircle(x[i], y[i], move_x[i], move_y[i], radius);
+}
+
 void RenderMap(GraphicsEngine* gfx)
 {
 	for (size_t raw = 0; raw < RAW_TILE_NUM; raw++)
@@ -79,6 +735,8 @@ void RenderMap(GraphicsEngine* gfx)
 			case 5: tile_color = OPAQUE_GRAY_COLOR; break;
 			case 6: tile_color = GREEN_COLOR; break;
 			case 7: tile_color = WOOD_COLOR; break;
+			case DOOR_TILE: tile_color = IsSolidTile((int)raw, (int)col) ? WOOD_COLOR : BLACK_COLOR; break;
+			case GRATE_TILE: tile_color = DARK_GRAY_COLOR; break;
 			default: tile_color = WHITE_COLOR; break;
 			}
 
@@ -101,8 +759,8 @@ void RenderMap(GraphicsEngine* gfx)
 
 struct Player
 {
-	float x = WINDOW_WIDTH * 0.5f;
-	float y = WINDOW_HEIGHT * 0.5f;
+	Real x = Real(WINDOW_WIDTH / 2);
+	Real y = Real(WINDOW_HEIGHT / 2);
 	float size = 10.0f;
 	float rotation_angle = PI / 2.0f;
 	float walk_direction = 0; // 1 or -1 walk forward, backward
@@ -110,469 +768,3547 @@ struct Player
 	float wlak_speed = 200.0f;
 	float turn_speed = 90.0f * TORAD;
 
+	// fixed point mode state, heading in 16.16 fine angles and speeds per tic
+	fixed_t fine_angle = IntToFixed(FINEANGLES / 4);
+	fixed_t fixed_walk_speed = IntToFixed(200) / TICRATE;
+	fixed_t fixed_turn_speed = IntToFixed(FINEANGLES / 4) / TICRATE;
+
+	// heading in fine angles, the column step the view is centered on
+	long long ViewAngle() const
+	{
+#if FIXED_POINT_MODE
+		return fine_angle >> FRACBITS;
+#else
+		return (long long)floor(rotation_angle / (FOV_ANGLE / NUM_RAYS) + 0.5);
+#endif
+	}
+
+#if FIXED_POINT_MODE
+	// one simulation step at TICRATE, integer only so replays match everywhere
+	void UpdateTic()
+	{
+		fine_angle += fixed_turn_speed * (int)turn_direction;
+		long long angle = fine_angle >> FRACBITS;
+		rotation_angle = angle * (FOV_ANGLE / NUM_RAYS);
 
+		Fixed step = Fixed::FromRaw(fixed_walk_speed * (int)walk_direction);
+		SlideCircle(x, y, AngleCos(angle) * step, AngleSin(angle) * step, ToReal(size));
+	}
+#else
 	void Update(float dt)
 	{
 		rotation_angle += turn_speed * turn_direction * dt;
 
-		float new_x = x + cosf(rotation_angle) * wlak_speed * walk_direction * dt;
-		float new_y = y + sinf(rotation_angle) * wlak_speed * walk_direction * dt;
+		float step = wlak_speed * walk_direction * dt;
+		SlideCircle(x, y, cosf(rotation_angle) * step, sinf(rotation_angle) * step, size);
+	}
+#endif
+
+	void Render(GraphicsEngine* gfx)
+	{
+		gfx-> DrawCircle(
+			ToFloat(x) * MAP_SCALING_FACTOR,
+			ToFloat(y) * MAP_SCALING_FACTOR,
+			size * MAP_SCALING_FACTOR,
+			RED_COLOR);
+
+		gfx->DrawLine(
+			ToFloat(x) * MAP_SCALING_FACTOR,
+			ToFloat(y) * MAP_SCALING_FACTOR,
+			(ToFloat(x) + cosf(rotation_angle) * 100.0f ) * MAP_SCALING_FACTOR,
+			(ToFloat(y) + sinf(rotation_angle) * 100.0f ) * MAP_SCALING_FACTOR,
+			RED_COLOR);
+	}
+};
+Player player;
+
+/////////////////////////////////////////////////////////////////
+
 
-		int raw = (int)(floor(new_y / TILE_SIZE));
-		int col = (int)(floor(new_x / TILE_SIZE));
 
-		if (map[raw][col] == 0)
-		{
-			x = new_x;
-			y = new_y;
+//////////////////////////// RAY CASTING ////////////////////////
+
+
+#define SIDE_HORIZONTAL 0    // hit a horizontal grid line, north or south face
+#define SIDE_VERTICAL 1      // hit a vertical grid line, east or west face
+
+inline int FaceId(int raw, int col, int side)
+{
+	return ((raw * COL_TILE_NUM + col) << 1) | side;
+}
+
+// which of the four faces of the tile a hit is on, hits lie exactly on the
+// grid line of their face
+inline int TileFaceOf(int raw, int col, int side, Real hit_x, Real hit_y)
+{
+	if (side == SIDE_VERTICAL)
+		return FloorToInt(hit_x) / TILE_SIZE == col ? TILE_FACE_WEST : TILE_FACE_EAST;
+	return FloorToInt(hit_y) / TILE_SIZE == raw ? TILE_FACE_NORTH : TILE_FACE_SOUTH;
+}
+
+// grid traversal (DDA), steps a line from tile boundary to tile boundary,
+// ray casting and the line of sight checks both walk the grid with it
+struct GridWalker
+{
+	int col, raw;
+	int step_col, step_raw;
+	Real t_max_x, t_max_y;        // distance along the direction to the next vertical / horizontal grid line
+	Real t_delta_x, t_delta_y;    // and between two of them
+
+	// the direction doesn't have to be unit length, distances are in its units
+	GridWalker(Real x, Real y, Real dir_x, Real dir_y)
+	{
+		bool facing_right = dir_x > Real(0);
+		bool facing_down = dir_y > Real(0);
+
+		col = FloorToInt(x) / TILE_SIZE;
+		raw = FloorToInt(y) / TILE_SIZE;
+
+		step_col = facing_right ? 1 : -1;
+		step_raw = facing_down ? 1 : -1;
+
+		Real next_x = Real((facing_right ? col + 1 : col) * TILE_SIZE);
+		Real next_y = Real((facing_down ? raw + 1 : raw) * TILE_SIZE);
+
+		t_max_x = dir_x != Real(0) ? (next_x - x) / dir_x : REAL_FAR;
+		t_max_y = dir_y != Real(0) ? (next_y - y) / dir_y : REAL_FAR;
+		t_delta_x = dir_x != Real(0) ? Real(TILE_SIZE) / Abs(dir_x) : REAL_FAR;
+		t_delta_y = dir_y != Real(0) ? Real(TILE_SIZE) / Abs(dir_y) : REAL_FAR;
+
+		// nearly axis aligned rays saturate in fixed point, keep the sums in range
+		t_max_x = t_max_x < REAL_FAR ? t_max_x : REAL_FAR;
+		t_max_y = t_max_y < REAL_FAR ? t_max_y : REAL_FAR;
+		t_delta_x = t_delta_x < REAL_FAR ? t_delta_x : REAL_FAR;
+		t_delta_y = t_delta_y < REAL_FAR ? t_delta_y : REAL_FAR;
+	}
+
+	// moves into the next tile, returns the distance it was entered at and
+	// whether that crossed a vertical grid line
+	Real Step(bool& vertical)
+	{
+		vertical = t_max_x < t_max_y;
+		Real t;
+
+		if (vertical)
+		{
+			t = t_max_x;
+			t_max_x += t_delta_x;
+			col += step_col;
+		}
+		else
+		{
+			t = t_max_y;
+			t_max_y += t_delta_y;
+			raw += step_raw;
+		}
+		return t;
+	}
+
+	// skips through the empty square of `radius` rings around the current
+	// tile in one go, the walker ends up in the tile the steps would have
+	// reached and the next Step() leaves the square, so it is exact again.
+	// ties go the way Step() takes them, horizontal crossings first
+	void Leap(int radius)
+	{
+		Real exit_x = Crossing(t_max_x, t_delta_x, radius);
+		Real exit_y = Crossing(t_max_y, t_delta_y, radius);
+
+		if (exit_x < exit_y)
+		{
+			int raws = CrossingsBefore(t_max_y, t_delta_y, exit_x, true, radius);
+			t_max_x = exit_x;
+			t_max_y = Advance(t_max_y, t_delta_y, raws);
+			col += step_col * radius;
+			raw += step_raw * raws;
+		}
+		else
+		{
+			int cols = CrossingsBefore(t_max_x, t_delta_x, exit_y, false, radius);
+			t_max_x = Advance(t_max_x, t_delta_x, cols);
+			t_max_y = exit_y;
+			col += step_col * cols;
+			raw += step_raw * radius;
+		}
+	}
+
+	// distance of the grid line n lines after the next one, REAL_FAR when
+	// that is out of range
+	static Real Crossing(Real next, Real delta, int n)
+	{
+		if (!(next < REAL_FAR) || !(delta < (REAL_FAR - next) / Real(n)))
+			return REAL_FAR;
+		return next + delta * Real(n);
+	}
+
+	// the same for n lines known to be in range, a float axis that is
+	// never crossed has infinite distances and moves by no lines
+	static Real Advance(Real next, Real delta, int n)
+	{
+		return n == 0 ? next : next + delta * Real(n);
+	}
+
+	// how many of the grid lines from `next` on come before the limit, at
+	// most `most`, the guess from the division is settled against the sums
+	// the walker keeps. the line past the last one counted is within delta
+	// of the limit, so the sums stay in range
+	static int CrossingsBefore(Real next, Real delta, Real limit, bool inclusive, int most)
+	{
+		if (inclusive ? next > limit : !(next < limit))
+			return 0;
+
+		int n = FloorToInt((limit - next) / delta) + 1;
+		n = n < 1 ? 1 : (n > most ? most : n);
+		while (n > 1 && !Before(Advance(next, delta, n - 1), limit, inclusive))
+			n--;
+		while (n < most && Before(Advance(next, delta, n), limit, inclusive))
+			n++;
+		return n;
+	}
+
+	static bool Before(Real t, Real limit, bool inclusive)
+	{
+		return inclusive ? !(t > limit) : t < limit;
+	}
+};
+
+#define CLEARANCE_MIN_LEAP 2    // leaps over a single ring cost more than the steps
+
+// RayBuffers::Cast() leaps over open space with the clearance field, it
+// finds the same faces either way. the leaps only pay off in open areas
+// several tiles across, so it starts off
+bool clearance_skipping = false;
+
+#define MAX_MASKED_HITS 4    // grates one column sees through, any past the last are not drawn
+
+// a grate a ray went through, drawn over whatever the ray hit behind it
+struct MaskedHit
+{
+	Real distance;
+	uint16_t hit_u;
+	uint8_t texture;
+	uint8_t side;
+	int32_t face;
+};
+
+// one frame of ray results as parallel arrays with one entry per column, a
+// pass that needs one field (the sprite depth test only reads distance)
+// streams just that array. the view's columns are one pixel and one fine
+// angle wide, so the renderers and the per column tables (column_cos,
+// column_tan) expect NUM_RAYS of them, other counts are for rays cast on
+// their own like TraceHitscan()
+struct RayBuffers
+{
+	int count = 0;
+
+	// per column direction, only depends on the view angle
+	Real* dir_x = nullptr;
+	Real* dir_y = nullptr;
+
+	Real* distance = nullptr;     // along the ray, REAL_FAR when the ray left the map
+	uint16_t* hit_u = nullptr;    // offset of the hit along the wall face, 0 .. TILE_SIZE - 1
+	uint8_t* texture = nullptr;   // wall texture index
+	uint8_t* side = nullptr;      // SIDE_HORIZONTAL or SIDE_VERTICAL
+	int32_t* face = nullptr;      // FaceId of the hit, -1 when nothing was hit
+
+	// MAX_MASKED_HITS slots per column, nearest first, the hits of a column
+	// are only ever read together so they are kept as one small stack
+	uint8_t* masked_count = nullptr;
+	MaskedHit* masked = nullptr;
+
+	TileSet visited;              // every tile a ray crossed, including the walls hit
+
+	void Allocate(FrameArena& arena, int column_count)
+	{
+		count = column_count;
+		dir_x = arena.Alloc<Real>(count);
+		dir_y = arena.Alloc<Real>(count);
+		distance = arena.Alloc<Real>(count);
+		hit_u = arena.Alloc<uint16_t>(count);
+		texture = arena.Alloc<uint8_t>(count);
+		side = arena.Alloc<uint8_t>(count);
+		face = arena.Alloc<int32_t>(count);
+		masked_count = arena.Alloc<uint8_t>(count);
+		masked = arena.Alloc<MaskedHit>(count * MAX_MASKED_HITS);
+	}
+
+	// columns [source_begin, source_begin + n) of source to [begin, begin + n)
+	void CopyColumns(const RayBuffers& source, int source_begin, int begin, int n)
+	{
+		memcpy(dir_x + begin, source.dir_x + source_begin, sizeof(Real) * n);
+		memcpy(dir_y + begin, source.dir_y + source_begin, sizeof(Real) * n);
+		memcpy(distance + begin, source.distance + source_begin, sizeof(Real) * n);
+		memcpy(hit_u + begin, source.hit_u + source_begin, sizeof(uint16_t) * n);
+		memcpy(texture + begin, source.texture + source_begin, sizeof(uint8_t) * n);
+		memcpy(side + begin, source.side + source_begin, sizeof(uint8_t) * n);
+		memcpy(face + begin, source.face + source_begin, sizeof(int32_t) * n);
+		memcpy(masked_count + begin, source.masked_count + source_begin, sizeof(uint8_t) * n);
+		memcpy(masked + begin * MAX_MASKED_HITS, source.masked + source_begin * MAX_MASKED_HITS, sizeof(MaskedHit) * MAX_MASKED_HITS * n);
+	}
+
+	void SetAngle(int i, long long fine_angle)
+	{
+		dir_x[i] = AngleCos(fine_angle);
+		dir_y[i] = AngleSin(fine_angle);
+	}
+
+	void SetHit(int i, Real t, Real hit_x, Real hit_y, int raw, int col, int hit_side)
+	{
+		distance[i] = t;
+		hit_u[i] = (uint16_t)(FloorToInt(hit_side == SIDE_VERTICAL ? hit_y : hit_x) % TILE_SIZE);
+		texture[i] = Tiles.At(raw, col).texture[TileFaceOf(raw, col, hit_side, hit_x, hit_y)];
+		side[i] = (uint8_t)hit_side;
+		face[i] = FaceId(raw, col, hit_side);
+	}
+
+	// a grate the ray entered, false when it hit a bar and stops there like on
+	// a wall, otherwise the hit goes on the column's stack and the ray goes on
+	bool AddMaskedHit(int i, Real t, Real hit_x, Real hit_y, int raw, int col, int hit_side)
+	{
+		int u = FloorToInt(hit_side == SIDE_VERTICAL ? hit_y : hit_x) % TILE_SIZE;
+		if (IsGrateBar(u))
+			return false;
+
+		if (masked_count[i] < MAX_MASKED_HITS)
+		{
+			MaskedHit& hit = masked[i * MAX_MASKED_HITS + masked_count[i]++];
+			hit.distance = t;
+			hit.hit_u = (uint16_t)u;
+			hit.texture = Tiles.At(raw, col).texture[TileFaceOf(raw, col, hit_side, hit_x, hit_y)];
+			hit.side = (uint8_t)hit_side;
+			hit.face = FaceId(raw, col, hit_side);
+		}
+		return true;
+	}
+
+	// along is where the ray crossed the door plane, measured along the door
+	void SetDoorHit(int i, Real t, Real along, int door)
+	{
+		int hit_side = Doors.vertical[door] ? SIDE_VERTICAL : SIDE_HORIZONTAL;
+		distance[i] = t;
+		hit_u[i] = (uint16_t)FloorToInt(along - Doors.open[door] * Real(TILE_SIZE));
+		texture[i] = DOOR_TEXTURE;
+		side[i] = (uint8_t)hit_side;
+		face[i] = FaceId(Doors.raw[door], Doors.col[door], hit_side);
+	}
+
+	// the door in a tile the ray entered, false when the ray leaves the tile
+	// before it reaches the plane or goes through the part slid open
+	bool CastDoor(int i, Real x, Real y, int door)
+	{
+		bool vertical = Doors.vertical[door];
+		Real ray_dir = vertical ? dir_x[i] : dir_y[i];
+		if (ray_dir == Real(0))
+			return false;
+
+		int tile = vertical ? Doors.col[door] : Doors.raw[door];
+		Real plane = Real(tile * TILE_SIZE + TILE_SIZE / 2);
+		Real t = (plane - (vertical ? x : y)) / ray_dir;
+		if (t < Real(0))
+			return false;
+
+		int cross_tile = vertical ? Doors.raw[door] : Doors.col[door];
+		Real cross = (vertical ? y + t * dir_y[i] : x + t * dir_x[i]) - Real(cross_tile * TILE_SIZE);
+		if (cross < Real(0) || !(cross < Real(TILE_SIZE)) || cross < Doors.open[door] * Real(TILE_SIZE))
+			return false;
+
+		SetDoorHit(i, t, cross, door);
+		return true;
+	}
+
+	// first solid tile from (x, y) along column i, doors are hit at the
+	// middle of their tile and rays keep going through the open part, and
+	// through the gaps of grates
+	void Cast(int i, Real x, Real y)
+	{
+		distance[i] = REAL_FAR;
+		hit_u[i] = 0;
+		texture[i] = 0;
+		side[i] = SIDE_HORIZONTAL;
+		face[i] = -1;
+		masked_count[i] = 0;
+
+		Real ray_dir_x = dir_x[i];
+		Real ray_dir_y = dir_y[i];
+		bool facing_right = ray_dir_x > Real(0);
+		bool facing_down = ray_dir_y > Real(0);
+
+		GridWalker walker(x, y, ray_dir_x, ray_dir_y);
+		for (;;)
+		{
+			// far from anything, the steps through the open square can't hit
+			if (clearance_skipping)
+			{
+				int clearance = Clearance.At(walker.raw, walker.col);
+				if (clearance > CLEARANCE_MIN_LEAP)
+					walker.Leap(clearance - 1);
+			}
+
+			bool vertical;
+			Real t = walker.Step(vertical);
+			int raw = walker.raw;
+			int col = walker.col;
+
+			if (raw < 0 || col < 0 || raw >= RAW_TILE_NUM || col >= COL_TILE_NUM)
+				return;
+
+			// empty floor costs one bit
+			if (!Tiles.IsFilled(raw, col))
+				continue;
+
+			const TileInfo& tile = Tiles.At(raw, col);
+			if (tile.door != NO_DOOR)
+			{
+				if (CastDoor(i, x, y, tile.door))
+					return;
+				continue;
+			}
+
+			Real hit_x = vertical ? Real((facing_right ? col : col + 1) * TILE_SIZE) : x + t * ray_dir_x;
+			Real hit_y = vertical ? y + t * ray_dir_y : Real((facing_down ? raw : raw + 1) * TILE_SIZE);
+			int hit_side = vertical ? SIDE_VERTICAL : SIDE_HORIZONTAL;
+
+			if ((tile.flags & TILE_GRATE) && AddMaskedHit(i, t, hit_x, hit_y, raw, col, hit_side))
+				continue;
+
+			SetHit(i, t, hit_x, hit_y, raw, col, hit_side);
+			return;
+		}
+	}
+
+	bool HitsSameFace(int a, int b) const
+	{
+		return face[a] != -1 && face[a] == face[b];
+	}
+
+	bool SeesThroughSameGrates(int a, int b) const
+	{
+		if (masked_count[a] != masked_count[b])
+			return false;
+		for (int k = 0; k < masked_count[a]; k++)
+		{
+			if (masked[a * MAX_MASKED_HITS + k].face != masked[b * MAX_MASKED_HITS + k].face)
+				return false;
+		}
+		return true;
+	}
+
+	// whether a door that is not all the way open lies between columns a and
+	// b seen from (x, y), which hit the same face, its closed part can stop
+	// the columns in between while both of them go past it. the whole door
+	// tile is tested, a door is only left out when its tile is past the
+	// face, past the same edge ray or behind the origin, and a door both
+	// columns hit stops every column in between too
+	bool DoorBetween(int a, int b, Real x, Real y) const
+	{
+		int face_raw = (face[a] >> 1) / COL_TILE_NUM;
+		int face_col = (face[a] >> 1) % COL_TILE_NUM;
+		bool face_vertical = (face[a] & 1) == SIDE_VERTICAL;
+		bool face_after = face_vertical ? FloorToInt(x) / TILE_SIZE < face_col : FloorToInt(y) / TILE_SIZE < face_raw;
+
+		for (int d = 0; d < Doors.count; d++)
+		{
+			if (!(Doors.open[d] < Real(1)))
+				continue;
+			if (Doors.raw[d] == face_raw && Doors.col[d] == face_col)
+				continue;
+
+			// the face is on a grid line, tiles from its own on are behind it
+			int door_line = face_vertical ? Doors.col[d] : Doors.raw[d];
+			int face_line = face_vertical ? face_col : face_raw;
+			if (face_after ? door_line >= face_line : door_line <= face_line)
+				continue;
+
+			Real left = Real(Doors.col[d] * TILE_SIZE) - x;
+			Real top = Real(Doors.raw[d] * TILE_SIZE) - y;
+			bool past_a = true;
+			bool past_b = true;
+			bool behind = true;
+			for (int corner = 0; corner < 4; corner++)
+			{
+				Real corner_x = corner & 1 ? left + Real(TILE_SIZE) : left;
+				Real corner_y = corner & 2 ? top + Real(TILE_SIZE) : top;
+
+				// columns turn the way the fine angle grows, so the ones in
+				// between are left of b and right of a
+				past_a = past_a && dir_x[a] * corner_y - dir_y[a] * corner_x < Real(0);
+				past_b = past_b && Real(0) < dir_x[b] * corner_y - dir_y[b] * corner_x;
+				behind = behind && !(Real(0) < dir_x[a] * corner_x + dir_y[a] * corner_y) && !(Real(0) < dir_x[b] * corner_x + dir_y[b] * corner_y);
+			}
+			if (!past_a && !past_b && !behind)
+				return true;
+		}
+		return false;
+	}
+
+	// distance along column i from (x, y) to the plane of a wall face, the
+	// face is on the side of its tile that looks at the origin
+	Real CrossFace(int i, int face_id, Real x, Real y, Real& hit_x, Real& hit_y) const
+	{
+		int raw = (face_id >> 1) / COL_TILE_NUM;
+		int col = (face_id >> 1) % COL_TILE_NUM;
+
+		if ((face_id & 1) == SIDE_VERTICAL)
+		{
+			Real plane_x = Real(col * TILE_SIZE);
+			if (!(x < plane_x))
+				plane_x = Real((col + 1) * TILE_SIZE);
+
+			Real t = (plane_x - x) / dir_x[i];
+			hit_x = plane_x;
+			hit_y = y + t * dir_y[i];
+			return t;
+		}
+
+		Real plane_y = Real(raw * TILE_SIZE);
+		if (!(y < plane_y))
+			plane_y = Real((raw + 1) * TILE_SIZE);
+
+		Real t = (plane_y - y) / dir_y[i];
+		hit_x = x + t * dir_x[i];
+		hit_y = plane_y;
+		return t;
+	}
+
+	// resolves column i from (x, y) against the wall face column `other`
+	// hit, exact for any column between two columns that hit that face and
+	// see through the same grates
+	void HitFace(int i, int other, Real x, Real y)
+	{
+		Real hit_x, hit_y;
+
+		// the grates are crossed on the same faces too, but this column can
+		// hit a bar of one where the other went through a gap
+		masked_count[i] = 0;
+		for (int k = 0; k < masked_count[other]; k++)
+		{
+			int grate_face = masked[other * MAX_MASKED_HITS + k].face;
+			Real t = CrossFace(i, grate_face, x, y, hit_x, hit_y);
+			int raw = (grate_face >> 1) / COL_TILE_NUM;
+			int col = (grate_face >> 1) % COL_TILE_NUM;
+			if (!AddMaskedHit(i, t, hit_x, hit_y, raw, col, grate_face & 1))
+			{
+				SetHit(i, t, hit_x, hit_y, raw, col, grate_face & 1);
+				return;
+			}
+		}
+
+		int hit_side = face[other] & 1;
+		int raw = (face[other] >> 1) / COL_TILE_NUM;
+		int col = (face[other] >> 1) % COL_TILE_NUM;
+
+		// a door between two columns that hit it is hit by every column between,
+		// unless rounding puts the crossing just past its edge
+		int door = Doors.At(raw, col);
+		if (door != -1)
+		{
+			if (!CastDoor(i, x, y, door))
+				Cast(i, x, y);
+			return;
+		}
+
+		Real t = CrossFace(i, face[other], x, y, hit_x, hit_y);
+
+		// the other column stopped on a bar of a grate, this one can be in a gap
+		if ((Tiles.At(raw, col).flags & TILE_GRATE) && !IsGrateBar(FloorToInt(hit_side == SIDE_VERTICAL ? hit_y : hit_x) % TILE_SIZE))
+		{
+			Cast(i, x, y);
+			return;
+		}
+
+		SetHit(i, t, hit_x, hit_y, raw, col, hit_side);
+	}
+
+	// builds visited from the hits alone, so columns the cache kept or
+	// resolved without walking the grid count too: a run of columns on one
+	// face sweeps the triangle from the origin to that face, and two runs are
+	// joined by the triangle between their edge rays, which can only add tiles
+	void MarkVisitedTiles(Real x, Real y)
+	{
+		const float max_reach = (float)((COL_TILE_NUM + RAW_TILE_NUM) * TILE_SIZE);
+		float origin_x = ToFloat(x);
+		float origin_y = ToFloat(y);
+
+		auto hit_x = [&](int i) { return origin_x + ToFloat(dir_x[i]) * (face[i] == -1 ? max_reach : ToFloat(distance[i])); };
+		auto hit_y = [&](int i) { return origin_y + ToFloat(dir_y[i]) * (face[i] == -1 ? max_reach : ToFloat(distance[i])); };
+
+		visited.Clear();
+		int run_begin = 0;
+		for (int i = 1; i <= count; i++)
+		{
+			if (i < count && HitsSameFace(run_begin, i))
+				continue;
+
+			// hits lie on the tile edge, so the wall itself is set from the face
+			if (face[run_begin] != -1)
+				visited.Set(face[run_begin] >> 1);
+
+			int run_end = i - 1;
+			visited.FillTriangle(origin_x, origin_y, hit_x(run_begin), hit_y(run_begin), hit_x(run_end), hit_y(run_end));
+			if (i < count)
+				visited.FillTriangle(origin_x, origin_y, hit_x(run_end), hit_y(run_end), hit_x(i), hit_y(i));
+			run_begin = i;
+		}
+	}
+
+	void Render(GraphicsEngine* gfx, Real x, Real y)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (face[i] == -1)
+				continue;
+
+			gfx->DrawLine(
+				ToFloat(x) * MAP_SCALING_FACTOR,
+				ToFloat(y) * MAP_SCALING_FACTOR,
+				ToFloat(x + distance[i] * dir_x[i]) * MAP_SCALING_FACTOR,
+				ToFloat(y + distance[i] * dir_y[i]) * MAP_SCALING_FACTOR,
+				BLUE_COLOR);
+		}
+	}
+};
+RayBuffers rays;
+
+#define RAY_SUBSAMPLE_STRIDE 8
+
+// casts every RAY_SUBSAMPLE_STRIDE-th column, then bisects the gaps between
+// samples that hit different faces and resolves the rest against the shared face
+bool adaptive_ray_subsampling = true;
+
+// rays are cast at whole multiples of the column step, so turning in place
+// shifts last frame's results by whole columns and only the columns that
+// came into view get cast, moving keeps the per column angle data.
+// every frame gets new buffers from the frame arena, last frame's buffers
+// live in the other arena and are still intact while the kept columns get copied
+struct RayCache
+{
+	bool valid = false;
+	Real origin_x = Real(0);
+	Real origin_y = Real(0);
+	long long first_angle_index = 0;
+	float view_angle = PI / 2.0f;   // view direction the cached columns are centered on
+	uint32_t door_changes = 0;      // Doors.changes the cached columns saw
+	uint32_t tile_edits = 0;        // and TileEdits
+	RayBuffers previous;
+
+	void CastColumn(int stripId)
+	{
+		rays.Cast(stripId, origin_x, origin_y);
+	}
+
+	// columns strictly between two cast columns
+	void RefineGap(int left, int right)
+	{
+		if (right - left < 2)
+			return;
+
+		if (rays.HitsSameFace(left, right) && rays.SeesThroughSameGrates(left, right) && !rays.DoorBetween(left, right, origin_x, origin_y))
+		{
+			for (int stripId = left + 1; stripId < right; stripId++)
+				rays.HitFace(stripId, left, origin_x, origin_y);
+			return;
+		}
+
+		int middle = (left + right) / 2;
+		CastColumn(middle);
+		RefineGap(left, middle);
+		RefineGap(middle, right);
+	}
+
+	void CastRange(int begin, int end)
+	{
+		if (!adaptive_ray_subsampling || end - begin <= 2)
+		{
+			for (int stripId = begin; stripId < end; stripId++)
+				CastColumn(stripId);
+			return;
+		}
+
+		int left = begin;
+		CastColumn(left);
+		while (left < end - 1)
+		{
+			int right = left + RAY_SUBSAMPLE_STRIDE < end - 1 ? left + RAY_SUBSAMPLE_STRIDE : end - 1;
+			CastColumn(right);
+			RefineGap(left, right);
+			left = right;
+		}
+	}
+
+	void SetAngles(int begin, int end)
+	{
+		for (int stripId = begin; stripId < end; stripId++)
+			rays.SetAngle(stripId, first_angle_index + stripId);
+	}
+
+	void Update(const Player& viewer, FrameArena& arena)
+	{
+		const int columns = NUM_RAYS;
+		long long angle_index = viewer.ViewAngle() - columns / 2;
+
+		bool same_origin = valid && viewer.x == origin_x && viewer.y == origin_y && Doors.changes == door_changes && TileEdits == tile_edits;
+		long long shift = angle_index - first_angle_index;
+
+		origin_x = viewer.x;
+		origin_y = viewer.y;
+		door_changes = Doors.changes;
+		tile_edits = TileEdits;
+		first_angle_index = angle_index;
+		view_angle = viewer.ViewAngle() * (FOV_ANGLE / NUM_RAYS);
+
+		previous = rays;
+		rays.Allocate(arena, columns);
+
+		if (!valid || previous.count != columns || llabs(shift) >= columns)
+		{
+			SetAngles(0, columns);
+			CastRange(0, columns);
+		}
+		else
+		{
+			// slide the kept columns, turning right makes new ones enter on the right
+			int entering = (int)llabs(shift);
+			int enter_begin = shift > 0 ? columns - entering : 0;
+			if (shift >= 0)
+				rays.CopyColumns(previous, entering, 0, columns - entering);
+			else
+				rays.CopyColumns(previous, 0, entering, columns - entering);
+			SetAngles(enter_begin, enter_begin + entering);
+
+			// moving changes every hit, turning in place only the entering columns
+			if (same_origin)
+				CastRange(enter_begin, enter_begin + entering);
+			else
+				CastRange(0, columns);
+		}
+
+		rays.MarkVisitedTiles(origin_x, origin_y);
+		valid = true;
+	}
+};
+RayCache ray_cache;
+
+/////////////////////////////////////////////////////////////////
+
+
+
+//////////////////////////// LINE OF SIGHT ////////////////////////
+
+
+#define SIGHT_BATCH_SIZE 64    // queries per job batch
+
+// true when no solid tile lies between the two points, walks the same grid
+// traversal as the rays but only up to the tile of the end point, with
+// doors_open only walls block, for what could be seen once doors open
+bool LineOfSight(Real from_x, Real from_y, Real to_x, Real to_y, bool doors_open = false)
+{
+	int to_col = FloorToInt(to_x) / TILE_SIZE;
+	int to_raw = FloorToInt(to_y) / TILE_SIZE;
+
+	GridWalker walker(from_x, from_y, to_x - from_x, to_y - from_y);
+
+	// a line crosses exactly one grid line per step, so it reaches the end tile after this many
+	int steps = abs(to_col - walker.col) + abs(to_raw - walker.raw);
+	for (; steps > 0; steps--)
+	{
+		bool vertical;
+		walker.Step(vertical);
+		if (doors_open ? IsWallTile(walker.raw, walker.col) : IsSolidTile(walker.raw, walker.col))
+			return false;
+	}
+	return true;
+}
+
+// many line of sight checks answered in one go on the job system, the
+// segments and answers live in the frame arena and a segment asked for
+// again before the next Clear() gets the cached answer
+struct SightBatch
+{
+	int capacity = 0;
+	int count = 0;
+	bool resolved = false;
+
+	Real* from_x = nullptr;
+	Real* from_y = nullptr;
+	Real* to_x = nullptr;
+	Real* to_y = nullptr;
+	uint8_t* visible = nullptr;
+
+	int32_t* table = nullptr;    // open addressing, query index or -1
+	uint32_t table_mask = 0;
+
+	void Begin(FrameArena& arena, int max_queries)
+	{
+		capacity = max_queries;
+		from_x = arena.Alloc<Real>(capacity);
+		from_y = arena.Alloc<Real>(capacity);
+		to_x = arena.Alloc<Real>(capacity);
+		to_y = arena.Alloc<Real>(capacity);
+		visible = arena.Alloc<uint8_t>(capacity);
+
+		uint32_t table_size = 16;
+		while (table_size < (uint32_t)capacity * 2)
+			table_size <<= 1;
+		table = arena.Alloc<int32_t>(table_size);
+		table_mask = table_size - 1;
+		Clear();
+	}
+
+	// forgets the queries but keeps the memory, for another round in the same frame
+	void Clear()
+	{
+		count = 0;
+		resolved = false;
+		memset(table, 0xFF, sizeof(int32_t) * (table_mask + 1));
+	}
+
+	// index of the answer, -1 when the batch is full
+	int Add(Real fx, Real fy, Real tx, Real ty)
+	{
+		uint32_t hash = RealBits(fx) * 0x9E3779B1u;
+		hash = (hash ^ RealBits(fy)) * 0x85EBCA77u;
+		hash = (hash ^ RealBits(tx)) * 0xC2B2AE3Du;
+		hash = (hash ^ RealBits(ty)) * 0x27D4EB2Fu;
+
+		for (uint32_t slot = hash & table_mask;; slot = (slot + 1) & table_mask)
+		{
+			int query = table[slot];
+			if (query == -1)
+			{
+				if (count >= capacity)
+					return -1;
+
+				query = count++;
+				from_x[query] = fx;
+				from_y[query] = fy;
+				to_x[query] = tx;
+				to_y[query] = ty;
+				table[slot] = query;
+				resolved = false;
+				return query;
+			}
+
+			if (from_x[query] == fx && from_y[query] == fy && to_x[query] == tx && to_y[query] == ty)
+				return query;
+		}
+	}
+
+	void Resolve(JobSystem* jobs)
+	{
+		jobs->ParallelFor(count, SIGHT_BATCH_SIZE, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				visible[i] = LineOfSight(from_x[i], from_y[i], to_x[i], to_y[i]) ? 1 : 0;
+		});
+		resolved = true;
+	}
+
+	bool IsVisible(int query) const
+	{
+		return query >= 0 && query < count && visible[query] != 0;
+	}
+};
+SightBatch Sight;
+
+/////////////////////////////////////////////////////////////////
+
+
+
+//////////////////////////// PVS ///////////////////////////
+
+
+#define PVS_ROW_BYTES ((MAP_TILE_COUNT + 7) / 8)
+#define PVS_SAMPLE_INSET 1     // sample points sit this far inside the tile corners
+#define PVS_PAIRS_PER_UPDATE 256    // tile pairs re-tested per update after a map edit
+
+// for every open tile, the open tiles that can be seen from somewhere inside
+// it, built at load since the map has no level file to keep it in, rows are
+// run length encoded like quake's, a zero byte is followed by how many zero
+// bytes it stands for, so the mostly empty rows of a big map stay small
+struct PotentiallyVisibleSet
+{
+	uint32_t row_start[MAP_TILE_COUNT + 1] = {};
+	uint8_t data[MAP_TILE_COUNT * PVS_ROW_BYTES * 2];   // a lone zero byte takes two
+
+	// rows a map edit touched, kept expanded until their pairs are re-tested
+	TileSet edited_rows[MAP_TILE_COUNT];
+	int16_t edited_slot[MAP_TILE_COUNT];    // a tile's row in edited_rows, -1 while it is only in data
+	uint16_t edited_tiles[MAP_TILE_COUNT];
+	int edited_count = 0;
+	int retest_a = 0;                       // next pair of edited_tiles to re-test
+	int retest_b = 0;
+
+	// a pair is visible when any line between the corners and centers of the
+	// two tiles is clear, adjacent open tiles always see each other
+	static bool TilesSeeEachOther(int from_raw, int from_col, int to_raw, int to_col)
+	{
+		// the corners and edge midpoints of the tile
+		static const int samples[8][2] =
+		{
+			{ PVS_SAMPLE_INSET, PVS_SAMPLE_INSET },
+			{ TILE_SIZE / 2, PVS_SAMPLE_INSET },
+			{ TILE_SIZE - PVS_SAMPLE_INSET, PVS_SAMPLE_INSET },
+			{ PVS_SAMPLE_INSET, TILE_SIZE / 2 },
+			{ TILE_SIZE - PVS_SAMPLE_INSET, TILE_SIZE / 2 },
+			{ PVS_SAMPLE_INSET, TILE_SIZE - PVS_SAMPLE_INSET },
+			{ TILE_SIZE / 2, TILE_SIZE - PVS_SAMPLE_INSET },
+			{ TILE_SIZE - PVS_SAMPLE_INSET, TILE_SIZE - PVS_SAMPLE_INSET },
+		};
+
+		if (abs(from_raw - to_raw) <= 1 && abs(from_col - to_col) <= 1)
+			return true;
+
+		for (const auto& from : samples)
+		{
+			Real from_x = Real(from_col * TILE_SIZE + from[0]);
+			Real from_y = Real(from_raw * TILE_SIZE + from[1]);
+
+			for (const auto& to : samples)
+			{
+				if (LineOfSight(from_x, from_y, Real(to_col * TILE_SIZE + to[0]), Real(to_raw * TILE_SIZE + to[1]), true))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	static bool IsWall(int tile)
+	{
+		return IsWallTile(tile / COL_TILE_NUM, tile % COL_TILE_NUM);
+	}
+
+	// run length encodes a row to out, returns the bytes written
+	static uint32_t EncodeRow(const TileSet& row, uint8_t* out)
+	{
+		uint32_t size = 0;
+		for (int k = 0; k < PVS_ROW_BYTES; k++)
+		{
+			uint8_t value = (uint8_t)(row.bits[k >> 3] >> ((k & 7) * 8));
+			if (value != 0)
+			{
+				out[size++] = value;
+				continue;
+			}
+
+			int run = 1;
+			while (k + run < PVS_ROW_BYTES && run < 255 && (uint8_t)(row.bits[(k + run) >> 3] >> (((k + run) & 7) * 8)) == 0)
+				run++;
+			out[size++] = 0;
+			out[size++] = (uint8_t)run;
+			k += run - 1;
+		}
+		return size;
+	}
+
+	void Build()
+	{
+		TileSet* rows = new TileSet[MAP_TILE_COUNT];
+		for (int t = 0; t < MAP_TILE_COUNT; t++)
+			rows[t].Clear();
+
+		// visibility is symmetric, each pair is tested once
+		for (int from = 0; from < MAP_TILE_COUNT; from++)
+		{
+			if (IsWall(from))
+				continue;
+
+			for (int to = from; to < MAP_TILE_COUNT; to++)
+			{
+				if (IsWall(to))
+					continue;
+				if (!TilesSeeEachOther(from / COL_TILE_NUM, from % COL_TILE_NUM, to / COL_TILE_NUM, to % COL_TILE_NUM))
+					continue;
+				rows[from].Set(to);
+				rows[to].Set(from);
+			}
+		}
+
+		uint32_t size = 0;
+		for (int t = 0; t < MAP_TILE_COUNT; t++)
+		{
+			row_start[t] = size;
+			size += EncodeRow(rows[t], data + size);
+		}
+		row_start[MAP_TILE_COUNT] = size;
+
+		memset(edited_slot, -1, sizeof(edited_slot));
+		edited_count = 0;
+
+		delete[] rows;
+	}
+
+	// the pairs the samples found, straight from the data or an edited row
+	void SampledRow(int tile, TileSet& out) const
+	{
+		if (edited_slot[tile] != -1)
+		{
+			out = edited_rows[edited_slot[tile]];
+			return;
+		}
+
+		out.Clear();
+		int k = 0;
+		for (uint32_t i = row_start[tile]; i < row_start[tile + 1]; i++)
+		{
+			if (data[i] == 0)
+			{
+				k += data[++i];
+				continue;
+			}
+			out.bits[k >> 3] |= (uint64_t)data[i] << ((k & 7) * 8);
+			k++;
+		}
+	}
+
+	// expands the row of a tile, solid tiles see nothing. samples can miss a
+	// line that threads between two corners, such a line runs next to tiles
+	// the samples did find, so the open neighbours of every sampled tile are
+	// added to stay on the safe side
+	void Row(int tile, TileSet& out) const
+	{
+		TileSet sampled;
+		SampledRow(tile, sampled);
+
+		out = sampled;
+		for (int v = 0; v < MAP_TILE_COUNT; v++)
+		{
+			if (!sampled.Has(v))
+				continue;
+
+			for (int r = v / COL_TILE_NUM - 1; r <= v / COL_TILE_NUM + 1; r++)
+				for (int c = v % COL_TILE_NUM - 1; c <= v % COL_TILE_NUM + 1; c++)
+					if (!IsWallTile(r, c))
+						out.Set(r * COL_TILE_NUM + c);
+		}
+	}
+
+	TileSet& EditableRow(int tile)
+	{
+		if (edited_slot[tile] == -1)
+		{
+			int slot = edited_count++;
+			SampledRow(tile, edited_rows[slot]);
+			edited_slot[tile] = (int16_t)slot;
+			edited_tiles[slot] = (uint16_t)tile;
+		}
+		return edited_rows[edited_slot[tile]];
+	}
+
+	// after the tile at (raw, col) changed, only pairs with a line through it
+	// can change, and both ends of such a line see into the tile, so they are
+	// in the rows of the tile's neighbours. an opened tile gives all of those
+	// pairs to each other right away and a closed one is taken out, which
+	// keeps the set conservative until Update() re-tested the pairs
+	void TileChanged(int raw, int col)
+	{
+		int tile = raw * COL_TILE_NUM + col;
+
+		TileSet around;
+		around.Clear();
+		around.Set(tile);
+		for (int r = raw - 1; r <= raw + 1; r++)
+		{
+			for (int c = col - 1; c <= col + 1; c++)
+			{
+				if (IsWallTile(r, c))
+					continue;
+
+				TileSet row;
+				Row(r * COL_TILE_NUM + c, row);
+				for (int k = 0; k < (MAP_TILE_COUNT + 63) / 64; k++)
+					around.bits[k] |= row.bits[k];
+			}
+		}
+
+		for (int t = 0; t < MAP_TILE_COUNT; t++)
+		{
+			if (!around.Has(t))
+				continue;
+
+			TileSet& row = EditableRow(t);
+			if (IsWall(t))
+			{
+				row.Clear();
+				continue;
+			}
+
+			if (IsWall(tile))
+				row.Unset(tile);
+			else
+				for (int k = 0; k < (MAP_TILE_COUNT + 63) / 64; k++)
+					row.bits[k] |= around.bits[k];
+		}
+
+		// pairs between rows edited before are tested again too
+		retest_a = 0;
+		retest_b = 0;
+	}
+
+	// re-tests a budget of the pairs among the edited rows, once they are all
+	// done the rows are packed back into the data
+	void Update()
+	{
+		int budget = PVS_PAIRS_PER_UPDATE;
+		while (retest_a < edited_count && budget > 0)
+		{
+			int a = edited_tiles[retest_a];
+			int b = edited_tiles[retest_b];
+			bool visible = !IsWall(a) && !IsWall(b) && TilesSeeEachOther(a / COL_TILE_NUM, a % COL_TILE_NUM, b / COL_TILE_NUM, b % COL_TILE_NUM);
+			if (visible)
+			{
+				edited_rows[retest_a].Set(b);
+				edited_rows[retest_b].Set(a);
+			}
+			else
+			{
+				edited_rows[retest_a].Unset(b);
+				edited_rows[retest_b].Unset(a);
+			}
+			budget--;
+
+			if (++retest_b == edited_count)
+			{
+				retest_a++;
+				retest_b = retest_a;
+			}
+		}
+
+		if (edited_count == 0 || retest_a < edited_count)
+			return;
+
+		// rows change size, so everything after the first edited row moves
+		uint8_t* packed = new uint8_t[sizeof(data)];
+		uint32_t size = 0;
+		TileSet row;
+		for (int t = 0; t < MAP_TILE_COUNT; t++)
+		{
+			SampledRow(t, row);
+			row_start[t] = size;
+			size += EncodeRow(row, packed + size);
+		}
+		row_start[MAP_TILE_COUNT] = size;
+		memcpy(data, packed, size);
+		delete[] packed;
+
+		for (int slot = 0; slot < edited_count; slot++)
+			edited_slot[edited_tiles[slot]] = -1;
+		edited_count = 0;
+		retest_a = 0;
+		retest_b = 0;
+	}
+};
+PotentiallyVisibleSet Pvs;
+
+/////////////////////////////////////////////////////////////////
+
+
+
+//////////////////////////// LIGHTING ///////////////////////////
+
+
+#define LIGHT_LEVELS 32
+#define LIGHT_BAND_SIZE (TILE_SIZE / 2)    // distance covered by one light level
+#define MIN_LIGHT 0.25f                    // brightness of the farthest light level
+#define VERTICAL_HIT_LIGHT_OFFSET 4        // vertical faces are drawn this many levels darker
+
+// doom style colormap, one shading ramp per light level so a texel
+// gets shaded with a table lookup instead of float math
+struct ColorMap
+{
+	uint16_t scale;     // brightness in 8.8, ramp[v] == (v * scale) >> 8 for the SIMD spans
+	uint8_t ramp[256];
+};
+ColorMap ColorMaps[LIGHT_LEVELS];
+
+void BuildColorMaps()
+{
+	for (int level = 0; level < LIGHT_LEVELS; level++)
+	{
+		float brightness = 1.0f - (1.0f - MIN_LIGHT) * ((float)level / (LIGHT_LEVELS - 1));
+		ColorMaps[level].scale = (uint16_t)(brightness * 256.0f + 0.5f);
+
+		for (int v = 0; v < 256; v++)
+			ColorMaps[level].ramp[v] = (uint8_t)((v * ColorMaps[level].scale) >> 8);
+	}
+}
+
+inline const ColorMap& SelectColorMap(float distance, bool was_vertical_hit)
+{
+	int level = (int)(distance / LIGHT_BAND_SIZE);
+	if (was_vertical_hit)
+		level += VERTICAL_HIT_LIGHT_OFFSET;
+
+	level = level < 0 ? 0 : level;
+	level = level >= LIGHT_LEVELS ? LIGHT_LEVELS - 1 : level;
+	return ColorMaps[level];
+}
+
+/////////////////////////////////////////////////////////////////
+
+#define MAX_MIP_LEVELS 8
+#define MIP_SLACK 4    // bytes after every level, lets the column kernels load a 3 byte texel as 32 bits
+
+struct Texture
+{
+	int w, h, bpp = 0;
+	uint8_t* data = nullptr;
+
+	// mip level i is (w >> i) x (h >> i), level 0 is data itself
+	int mip_count = 0;
+	uint8_t* mips[MAX_MIP_LEVELS] = {};
+
+	// keeps rgb and rgba images as they are, the column kernels have a version
+	// for each, gray images are expanded to rgba
+	void load(const char* path)
+	{
+		uint8_t* image = (uint8_t*)stbi_load(path, &w, &h, &bpp, 0);
+		if (image && bpp < 3)
+		{
+			stbi_image_free(image);
+			image = (uint8_t*)stbi_load(path, &w, &h, &bpp, 4);
+			bpp = 4;
+		}
+		if (!image)
+			return;
+
+		data = new uint8_t[w * h * bpp + MIP_SLACK]();
+		memcpy(data, image, w * h * bpp);
+		stbi_image_free(image);
+	}
+
+	// box filters every level from the previous one, color keyed textures
+	// (pink = transparent) only average their visible texels so the key
+	// color doesn't bleed into the edges of far sprites
+	void build_mips(bool color_keyed)
+	{
+		mips[0] = data;
+		mip_count = 1;
+
+		while (mip_count < MAX_MIP_LEVELS && (w >> mip_count) > 0 && (h >> mip_count) > 0)
+		{
+			int src_w = w >> (mip_count - 1);
+			int dst_w = w >> mip_count;
+			int dst_h = h >> mip_count;
+			const uint8_t* src = mips[mip_count - 1];
+			uint8_t* dst = new uint8_t[dst_w * dst_h * bpp + MIP_SLACK]();
+
+			for (int y = 0; y < dst_h; y++)
+			{
+				for (int x = 0; x < dst_w; x++)
+				{
+					int sum[4] = { 0, 0, 0, 0 };
+					int visible = 0;
+
+					for (int i = 0; i < 4; i++)
+					{
+						const uint8_t* texel = src + ((src_w * (y * 2 + (i >> 1))) + (x * 2 + (i & 1))) * bpp;
+						if (color_keyed && texel[0] == 255 && texel[1] == 0 && texel[2] == 255)
+							continue;
+
+						for (int c = 0; c < bpp; c++)
+							sum[c] += texel[c];
+						visible++;
+					}
+
+					uint8_t* out = dst + ((dst_w * y) + x) * bpp;
+					if (visible < 2)
+					{
+						// mostly transparent, keep it transparent
+						out[0] = 255; out[1] = 0; out[2] = 255;
+						if (bpp == 4)
+							out[3] = 255;
+					}
+					else
+					{
+						for (int c = 0; c < bpp; c++)
+							out[c] = (uint8_t)((sum[c] + visible / 2) / visible);
+					}
+				}
+			}
+
+			mips[mip_count++] = dst;
+		}
+	}
+
+	// smallest level that still has at least one texel row per screen pixel
+	int select_mip(int projected_size) const
+	{
+		int level = 0;
+		while (level + 1 < mip_count && (h >> (level + 1)) >= projected_size)
+			level++;
+		return level;
+	}
+
+	void free()
+	{
+		for (int i = 1; i < mip_count; i++)
+			delete[] mips[i];
+		mip_count = 0;
+
+		delete[] data;
+		data = nullptr;
+		w = h = bpp = 0;
+	}
+};
+#define TORCH_FRAMES 4
+#define WALL_IMAGE_COUNT (WALL_TEXTURE_COUNT + TORCH_FRAMES)
+
+Texture WallTextures[WALL_IMAGE_COUNT];    // a still image per texture id, then the frames of the animated ones
+Texture GuardTexture;
+
+// a texture id that steps through images of WallTextures on a timer
+struct WallAnimation
+{
+	uint8_t texture;
+	uint8_t first_image;
+	uint8_t frame_count;
+	uint16_t frame_ms;
+};
+
+const WallAnimation wall_animations[] =
+{
+	{ TORCH_TEXTURE, WALL_TEXTURE_COUNT, TORCH_FRAMES, 120 },
+};
+
+// the image every texture id draws with right now, animations swap the
+// pointers once a frame so the columns only look up their id
+struct WallAnimationSet
+{
+	const Texture* current[WALL_TEXTURE_COUNT];
+
+	void Init()
+	{
+		for (int id = 0; id < WALL_TEXTURE_COUNT; id++)
+			current[id] = &WallTextures[id];
+		Update(0);
+	}
+
+	// frames follow from the clock alone, nothing to carry between frames
+	void Update(uint64_t time_ms)
+	{
+		for (const WallAnimation& animation : wall_animations)
+		{
+			int frame = (int)((time_ms / animation.frame_ms) % animation.frame_count);
+			current[animation.texture] = &WallTextures[animation.first_image + frame];
+		}
+	}
+};
+WallAnimationSet WallAnimations;
+
+// a copy of the source with its colors scaled, for frames that only change brightness
+void BuildShadedTexture(Texture& texture, const Texture& source, int percent)
+{
+	int size = source.w * source.h * source.bpp;
+	texture.w = source.w;
+	texture.h = source.h;
+	texture.bpp = source.bpp;
+	texture.data = new uint8_t[size + MIP_SLACK]();
+
+	for (int b = 0; b < size; b++)
+	{
+		int value = b % source.bpp == 3 ? source.data[b] : source.data[b] * percent / 100;    // alpha stays
+		texture.data[b] = (uint8_t)(value > 255 ? 255 : value);
+	}
+	texture.build_mips(false);
+}
+
+// a torch lit wall, the frames flicker between darker and brighter copies of it
+void BuildTorchTexture(const Texture& source)
+{
+	static const int flicker[TORCH_FRAMES] = { 100, 125, 110, 135 };
+
+	for (int f = 0; f < TORCH_FRAMES; f++)
+		BuildShadedTexture(WallTextures[WALL_TEXTURE_COUNT + f], source, flicker[f]);
+}
+
+// iron bars on the pink color key, one texel per unit of the tile so hit_u
+// picks the texel column IsGrateBar() was asked about, and the bar columns
+// stay opaque on every mip level since each 2x2 box keeps two bar texels
+void BuildGrateTexture(Texture& texture)
+{
+	texture.w = TILE_SIZE;
+	texture.h = TILE_SIZE;
+	texture.bpp = 3;
+	texture.data = new uint8_t[TILE_SIZE * TILE_SIZE * 3 + MIP_SLACK]();
+
+	for (int v = 0; v < TILE_SIZE; v++)
+	{
+		for (int u = 0; u < TILE_SIZE; u++)
+		{
+			uint8_t* texel = texture.data + (v * TILE_SIZE + u) * 3;
+			bool cross_bar = v % GRATE_BAR_SPACING < GRATE_BAR_WIDTH;
+			if (!IsGrateBar(u) && !cross_bar)
+			{
+				texel[0] = 255; texel[1] = 0; texel[2] = 255;
+				continue;
+			}
+
+			// lit from the top left, the far edge of a bar is darker
+			bool edge = IsGrateBar(u) ? u % GRATE_BAR_SPACING == GRATE_BAR_WIDTH - 1 : v % GRATE_BAR_SPACING == GRATE_BAR_WIDTH - 1;
+			uint8_t shade = edge ? 60 : 100;
+			texel[0] = shade;
+			texel[1] = shade;
+			texel[2] = (uint8_t)(shade + 10);
+		}
+	}
+
+	texture.build_mips(true);
+}
+
+ColumnKernels Kernels;
+
+// fills in the texture part of a column, rows are stepped in 16.16 so the
+// kernels never divide, `skipped` is how many rows of the full projection
+// are above the first pixel drawn
+inline void SetColumnTexture(TextureColumn& column, const Texture& texture, int mip, int tex_x, int projected_size, int skipped)
+{
+	column.texels = texture.mips[mip];
+	column.tex_w = texture.w >> mip;
+	column.tex_h = texture.h >> mip;
+	column.tex_x = tex_x;
+	column.v_step = (uint32_t)(((int64_t)column.tex_h << 16) / projected_size);
+	column.v = (uint32_t)((int64_t)skipped * column.v_step);
+}
+
+
+// cosine of every column's angle from the view direction, removes the fisheye
+Real column_cos[NUM_RAYS];
+
+void BuildColumnCosines()
+{
+	for (int stripId = 0; stripId < NUM_RAYS; stripId++)
+		column_cos[stripId] = AngleCos(stripId - NUM_RAYS / 2);
+}
+
+// one wall column ready for its kernel
+struct WallDrawCommand
+{
+	ColumnKernel kernel;
+	TextureColumn column;
+};
+
+// projects a wall hit at distance along column i, false when it covers no
+// pixel, masked columns leave the pink texels of the texture alone
+bool ProjectWallColumn(GraphicsEngine* gfx, int i, Real ray_distance, int texture_index, int hit_u, int hit_side, bool masked, WallDrawCommand& command)
+{
+	Real corrected_distance = ray_distance * column_cos[i];
+
+	int wallStripHeight = ProjectTileHeight(corrected_distance);
+
+	int wallTopPixel = (WINDOW_HEIGHT / 2) - (wallStripHeight / 2);
+	int wallTopPixel_no_clamp = wallTopPixel;
+	wallTopPixel = wallTopPixel < 0 ? 0 : wallTopPixel;
+
+	int wallBottomPixel = (WINDOW_HEIGHT / 2) + (wallStripHeight / 2);
+	wallBottomPixel = wallBottomPixel > WINDOW_HEIGHT ? WINDOW_HEIGHT : wallBottomPixel;
+
+	if (wallTopPixel >= wallBottomPixel)
+		return false;
+
+	// walls
+	const Texture& WallTexture = *WallAnimations.current[texture_index];
+	int mip = WallTexture.select_mip(wallStripHeight);
+	int textureOffsetX = hit_u * (WallTexture.w >> mip) / TILE_SIZE;
+
+	const ColorMap& colormap = SelectColorMap(ToFloat(ray_distance), hit_side == SIDE_VERTICAL);
+
+	TextureColumn& column = command.column;
+	column.dst = gfx->framebuffer + (WINDOW_WIDTH * wallTopPixel) + i;
+	column.pitch = WINDOW_WIDTH;
+	column.count = wallBottomPixel - wallTopPixel;
+	column.ramp = colormap.ramp;
+	column.scale = colormap.scale;
+	column.id_dst = nullptr;    // walls are not pickable
+	SetColumnTexture(column, WallTexture, mip, textureOffsetX, wallStripHeight, wallTopPixel - wallTopPixel_no_clamp);
+
+	command.kernel = Kernels.Get(column.tex_w, column.tex_h, WallTexture.bpp, masked);
+	return true;
+}
+
+// builds the draw list of the visible columns in the frame arena, then the
+// jobs run it, columns never overlap so the batches need no synchronization
+void Render3DProjectWalls(GraphicsEngine* gfx, JobSystem* jobs, FrameArena& arena)
+{
+	WallDrawCommand* commands = arena.Alloc<WallDrawCommand>(rays.count);
+	int command_count = 0;
+
+	for (int i = 0; i < rays.count; i++)
+	{
+		if (ProjectWallColumn(gfx, i, rays.distance[i], rays.texture[i], rays.hit_u[i], rays.side[i], false, commands[command_count]))
+			command_count++;
+	}
+
+	jobs->ParallelFor(command_count, 64, [&](int begin, int end)
+	{
+		for (int c = begin; c < end; c++)
+			commands[c].kernel(commands[c].column);
+	});
+}
+
+///////////////////////////////////////////////////////////////////
+
+
+
+/////////////////////////// FLOOR & CEILING ///////////////////////
+
+
+#define FLAT_TEXTURE_SIZE 64           // flats are resampled to this power of two at load
+#define FLAT_TEXTURE_SHIFT 6
+#define FLOOR_TEXTURE_INDEX 5
+#define CEILING_TEXTURE_INDEX 7
+
+// floor/ceiling texture packed in the framebuffer pixel format so a span
+// can fetch a texel with a single 32 bit load
+struct FlatTexture
+{
+	uint32_t* texels = nullptr;
+
+	void build(const Texture& source)
+	{
+		texels = new uint32_t[FLAT_TEXTURE_SIZE * FLAT_TEXTURE_SIZE];
+
+		for (int y = 0; y < FLAT_TEXTURE_SIZE; y++)
+		{
+			for (int x = 0; x < FLAT_TEXTURE_SIZE; x++)
+			{
+				int src_x = x * source.w / FLAT_TEXTURE_SIZE;
+				int src_y = y * source.h / FLAT_TEXTURE_SIZE;
+				const uint8_t* texel = source.data + ((source.w * src_y) + src_x) * source.bpp;
+
+				uint8_t a = source.bpp == 4 ? texel[3] : 255;
+				texels[(y << FLAT_TEXTURE_SHIFT) + x] = (texel[0] << 24) | (texel[1] << 16) | (texel[2] << 8) | a;
+			}
+		}
+	}
+
+	void free()
+	{
+		delete[] texels;
+		texels = nullptr;
+	}
+};
+FlatTexture FloorTexture;
+FlatTexture CeilingTexture;
+
+// tan of every column's angle offset from the view direction, the floor point
+// seen by column i is player + row_distance * (forward + column_tan[i] * right)
+// which keeps the spans in sync with the angle based wall columns
+alignas(16) float column_tan[NUM_RAYS];
+
+void BuildColumnTangents()
+{
+	float rayAngle = -(FOV_ANGLE / 2.0f);
+	for (int stripId = 0; stripId < NUM_RAYS; stripId++)
+	{
+		column_tan[stripId] = tanf(rayAngle);
+		rayAngle += FOV_ANGLE / NUM_RAYS;
+	}
+}
+
+// scales the rgb bytes of 4 texels by the colormap brightness, alpha is kept
+inline __m128i ShadeTexels(__m128i texels, __m128i scale)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(texels, zero), scale);
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(texels, zero), scale);
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+void RenderFlatRow(GraphicsEngine* gfx, int floor_y, float distance_proj_plane)
+{
+	int ceiling_y = WINDOW_HEIGHT - 1 - floor_y;
+
+	// one distance per row, camera sits half a tile above the floor
+	float row_distance = (TILE_SIZE * 0.5f * distance_proj_plane) / (floor_y + 0.5f - WINDOW_HEIGHT / 2);
+
+	float texels_per_unit = (float)FLAT_TEXTURE_SIZE / TILE_SIZE;
+	float forward_x = cosf(ray_cache.view_angle);
+	float forward_y = sinf(ray_cache.view_angle);
+
+	float base_u = (ToFloat(player.x) + row_distance * forward_x) * texels_per_unit;
+	float base_v = (ToFloat(player.y) + row_distance * forward_y) * texels_per_unit;
+	float step_u = -row_distance * forward_y * texels_per_unit;
+	float step_v = row_distance * forward_x * texels_per_unit;
+
+	const ColorMap& colormap = SelectColorMap(row_distance, false);
+
+	uint32_t* floor_row = gfx->framebuffer + WINDOW_WIDTH * floor_y;
+	uint32_t* ceiling_row = gfx->framebuffer + WINDOW_WIDTH * ceiling_y;
+
+	__m128 base_u4 = _mm_set1_ps(base_u);
+	__m128 base_v4 = _mm_set1_ps(base_v);
+	__m128 step_u4 = _mm_set1_ps(step_u);
+	__m128 step_v4 = _mm_set1_ps(step_v);
+	__m128i mask4 = _mm_set1_epi32(FLAT_TEXTURE_SIZE - 1);
+	__m128i scale4 = _mm_set_epi16(colormap.scale, colormap.scale, colormap.scale, 256, colormap.scale, colormap.scale, colormap.scale, 256);
+
+	int x = 0;
+	for (; x + 4 <= WINDOW_WIDTH; x += 4)
+	{
+		__m128 t = _mm_load_ps(column_tan + x);
+		__m128i u = _mm_and_si128(_mm_cvttps_epi32(_mm_add_ps(base_u4, _mm_mul_ps(t, step_u4))), mask4);
+		__m128i v = _mm_and_si128(_mm_cvttps_epi32(_mm_add_ps(base_v4, _mm_mul_ps(t, step_v4))), mask4);
+		__m128i index = _mm_or_si128(_mm_slli_epi32(v, FLAT_TEXTURE_SHIFT), u);
+
+		alignas(16) int32_t lanes[4];
+		_mm_store_si128((__m128i*)lanes, index);
+
+		__m128i floor_texels = _mm_set_epi32(
+			FloorTexture.texels[lanes[3]], FloorTexture.texels[lanes[2]],
+			FloorTexture.texels[lanes[1]], FloorTexture.texels[lanes[0]]);
+		__m128i ceiling_texels = _mm_set_epi32(
+			CeilingTexture.texels[lanes[3]], CeilingTexture.texels[lanes[2]],
+			CeilingTexture.texels[lanes[1]], CeilingTexture.texels[lanes[0]]);
+
+		_mm_storeu_si128((__m128i*)(floor_row + x), ShadeTexels(floor_texels, scale4));
+		_mm_storeu_si128((__m128i*)(ceiling_row + x), ShadeTexels(ceiling_texels, scale4));
+	}
+
+	// leftover columns when the width is not a multiple of 4
+	for (; x < WINDOW_WIDTH; x++)
+	{
+		int u = (int)(base_u + column_tan[x] * step_u) & (FLAT_TEXTURE_SIZE - 1);
+		int v = (int)(base_v + column_tan[x] * step_v) & (FLAT_TEXTURE_SIZE - 1);
+		int index = (v << FLAT_TEXTURE_SHIFT) + u;
+
+		uint32_t f = FloorTexture.texels[index];
+		uint32_t c = CeilingTexture.texels[index];
+		floor_row[x] = gfx->RGBtoUint(colormap.ramp[f >> 24], colormap.ramp[(f >> 16) & 0xFF], colormap.ramp[(f >> 8) & 0xFF], f & 0xFF);
+		ceiling_row[x] = gfx->RGBtoUint(colormap.ramp[c >> 24], colormap.ramp[(c >> 16) & 0xFF], colormap.ramp[(c >> 8) & 0xFF], c & 0xFF);
+	}
+}
+
+// fills the whole frame with floor and ceiling spans, walls draw over it
+void RenderFloorAndCeiling(GraphicsEngine* gfx, JobSystem* jobs)
+{
+	float distance_proj_plane = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
+
+	jobs->ParallelFor(WINDOW_HEIGHT / 2, 16, [&](int begin, int end)
+	{
+		for (int row = begin; row < end; row++)
+			RenderFlatRow(gfx, (WINDOW_HEIGHT / 2) + row, distance_proj_plane);
+	});
+}
+
+///////////////////////////////////////////////////////////////////
+
+struct PlayerSpriteSheet
+{
+	int w, h, bpp = 0;
+	int frame_width = 0;
+	int frame_count = 0;
+	int frames_per_sprite = 0;
+	uint8_t* data = nullptr;
+
+	int frame_counter = 0;
+	int current_frame = 0;
+	bool animation_finished = true;
+	bool is_playing = false;
+
+	void load(const char* path, int framewidth, int framecount, int framespersprite)
+	{
+		data = (uint8_t*)stbi_load(path, &w, &h, &bpp, 0);
+		frame_width = framewidth;
+		frame_count = framecount;
+		frames_per_sprite = framespersprite;
+	}
+
+	void free()
+	{
+		stbi_image_free(data);
+		w = h = bpp = 0;
+		frame_width = 0;
+		frame_count = 0;
+
+		frame_counter = 0;
+		current_frame = 0;
+		animation_finished = true;
+		is_playing = false;
+	}
+
+	void PlayAnimation()
+	{
+		frame_counter = 0;
+		current_frame = 0;
+		is_playing = true;
+	}
+
+	void Update()
+	{
+		if (is_playing)
+		{
+			frame_counter++;
+			int frame_index = frame_counter / frames_per_sprite;
+
+			if (frame_index >= frame_count) // exceeded the frame count in sprite sheet
+			{
+				current_frame = 0;
+				animation_finished = true;
+				is_playing = false;
+			}
+			else
+			{
+				current_frame = frame_index;
+				animation_finished = false;
+			}
+		}
+	}
+
+	void Render(GraphicsEngine* gfx)
+	{
+		int rect_w = frame_width;
+		int rect_h = h;
+		int start_x = WINDOW_WIDTH * 0.5f - rect_w * 0.5f;
+		int start_y = WINDOW_HEIGHT - rect_h;
+
+		int image_x = current_frame * frame_width;
+		int image_y = 0;
+
+		for (size_t y = start_y; y < start_y + rect_h; y++)
+		{
+			for (size_t x = start_x; x < start_x + rect_w; x++)
+			{
+				int src_index = ((w * image_y) + image_x) * 4;
+
+				uint8_t r = data[src_index + 0];
+				uint8_t g = data[src_index + 1];
+				uint8_t b = data[src_index + 2];
+				uint8_t a = data[src_index + 3];
+
+				if (a > 10)
+					gfx->framebuffer[(WINDOW_WIDTH * y) + x] = gfx->RGBtoUint(r, g, b, a);
+				image_x++;
+			}
+			image_x = current_frame * frame_width;
+			image_y++;
+		}
+	}
+};
+PlayerSpriteSheet PlayerGunSpriteSheet;
+
+///////////////////////////////// Sprite (Enemy, Doors, ... etc) ///////////////////////////
+
+// a sprite projected to the screen, sprites are drawn from a list of these
+// sorted far to near so closer sprites end up over farther ones
+struct SpriteDrawCommand
+{
+	const Texture* texture;
+	Real distance;
+	int left_x;
+	int size;
+	int frame;          // animation frame, frames sit left to right in the texture
+	int frame_count;
+	uint32_t slot;      // entity slot, written to the sprite id buffer
+	uint32_t generation;
+};
+
+#define SPRITE_ID_SLOT_BITS 13   // the rest of an id is the frame stamp
+
+// entity slot of the sprite on every pixel of the last frame, for picking
+// what is under the crosshair without tracing, ids carry the stamp of the
+// frame that wrote them so the buffer is never cleared between frames
+struct SpriteIdBuffer
+{
+	uint32_t ids[WINDOW_WIDTH * WINDOW_HEIGHT] = {};
+	uint32_t stamp = 0;     // 0 is never current, so the zeroed buffer holds no ids
+
+	// generation of every slot when its sprite was drawn, an id read back
+	// later is a handle that stops resolving once the entity is gone
+	uint32_t generation[1 << SPRITE_ID_SLOT_BITS] = {};
+
+	// before the sprites of a frame are drawn
+	void NextFrame()
+	{
+		stamp = (stamp + 1) & ((1u << (32 - SPRITE_ID_SLOT_BITS)) - 1);
+		if (stamp == 0)
+		{
+			// wrapped around, ids from a whole stamp cycle ago would look current
+			memset(ids, 0, sizeof(ids));
+			stamp = 1;
+		}
+	}
+
+	uint32_t Tag(uint32_t slot) const
+	{
+		return (stamp << SPRITE_ID_SLOT_BITS) | slot;
+	}
+
+	// slot of the sprite drawn at the pixel, -1 when it shows a wall or a flat
+	int SlotAt(int x, int y) const
+	{
+		uint32_t id = ids[y * WINDOW_WIDTH + x];
+		if (stamp == 0 || (id >> SPRITE_ID_SLOT_BITS) != stamp)
+			return -1;
+		return (int)(id & ((1u << SPRITE_ID_SLOT_BITS) - 1));
+	}
+};
+SpriteIdBuffer SpriteIds;
+
+// the grate layers of a frame, drawn in between the sprites: a sprite column
+// first draws the layers behind the sprite, and what is left goes on top once
+// every sprite is done, so each column is painted far to near
+struct MaskedWallDraws
+{
+	WallDrawCommand* commands = nullptr;   // MAX_MASKED_HITS per column, nearest first
+	Real* distance = nullptr;
+	uint8_t* left = nullptr;               // layers of a column still to draw, the farthest of them goes next
+
+	void Build(GraphicsEngine* gfx, FrameArena& arena)
+	{
+		commands = arena.Alloc<WallDrawCommand>(rays.count * MAX_MASKED_HITS);
+		distance = arena.Alloc<Real>(rays.count * MAX_MASKED_HITS);
+		left = arena.Alloc<uint8_t>(rays.count);
+
+		for (int i = 0; i < rays.count; i++)
+		{
+			int layers = 0;
+			for (int k = 0; k < rays.masked_count[i]; k++)
+			{
+				const MaskedHit& hit = rays.masked[i * MAX_MASKED_HITS + k];
+				WallDrawCommand& command = commands[i * MAX_MASKED_HITS + layers];
+				if (!ProjectWallColumn(gfx, i, hit.distance, hit.texture, hit.hit_u, hit.side, true, command))
+					continue;
+
+				// bars hide the sprites behind them from picking too
+				command.column.id_dst = SpriteIds.ids + (command.column.dst - gfx->framebuffer);
+				command.column.id = 0;
+				distance[i * MAX_MASKED_HITS + layers] = hit.distance;
+				layers++;
+			}
+			left[i] = (uint8_t)layers;
+		}
+	}
+
+	// draws the layers of column i that are farther away than depth
+	void DrawBehind(int i, Real depth)
+	{
+		while (left[i] > 0 && depth < distance[i * MAX_MASKED_HITS + left[i] - 1])
+		{
+			left[i]--;
+			const WallDrawCommand& command = commands[i * MAX_MASKED_HITS + left[i]];
+			command.kernel(command.column);
+		}
+	}
+
+	// after the sprites, columns are independent again
+	void DrawRest(JobSystem* jobs)
+	{
+		jobs->ParallelFor(rays.count, 64, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				DrawBehind(i, Real(0));
+		});
+	}
+};
+MaskedWallDraws MaskedWalls;
+
+// sort key that orders like the distance, positive floats order like their bits
+inline uint32_t DepthKey(Real distance)
+{
+	return RealBits(distance);
+}
+
+void DrawSprite(GraphicsEngine* gfx, const SpriteDrawCommand& command)
+{
+	const Texture& texture = *command.texture;
+	int sprite_size = command.size;
+	int spriteLeftX = command.left_x;
+
+	int spriteTopPixel = (WINDOW_HEIGHT / 2) - (sprite_size / 2);
+	int spriteTopPixel_no_clamp = spriteTopPixel;
+	spriteTopPixel = spriteTopPixel < 0 ? 0 : spriteTopPixel;
+
+	int spriteBottomPixel = (WINDOW_HEIGHT / 2) + (sprite_size / 2);
+	spriteBottomPixel = spriteBottomPixel > WINDOW_HEIGHT ? WINDOW_HEIGHT : spriteBottomPixel;
+
+	int spriteRightX = spriteLeftX + sprite_size;
+
+	int first_x = spriteLeftX < 0 ? 0 : spriteLeftX;
+	int last_x = spriteRightX > WINDOW_WIDTH ? WINDOW_WIDTH : spriteRightX;
+
+	const ColorMap& colormap = SelectColorMap(ToFloat(command.distance), false);
+
+	if (spriteTopPixel >= spriteBottomPixel)
+		return;
+
+	int mip = texture.select_mip(sprite_size);
+	int mip_w = texture.w >> mip;
+	int frame_w = mip_w / command.frame_count;
+	ColumnKernel kernel = Kernels.Get(mip_w, texture.h >> mip, texture.bpp, true);
+
+	TextureColumn column;
+	column.pitch = WINDOW_WIDTH;
+	column.count = spriteBottomPixel - spriteTopPixel;
+	column.ramp = colormap.ramp;
+	column.scale = colormap.scale;
+	column.id = SpriteIds.Tag(command.slot);
+	SpriteIds.generation[command.slot] = command.generation;
+
+	for (int x = first_x; x < last_x; x++)
+	{
+		if (!(command.distance < rays.distance[x]))
+			continue;
+
+		int texture_x_offset = command.frame * frame_w + (int)((int64_t)(x - spriteLeftX) * frame_w / sprite_size);
+
+		// pink texels are the color key and stay unwritten, in both buffers
+		column.dst = gfx->framebuffer + (WINDOW_WIDTH * spriteTopPixel) + x;
+		column.id_dst = SpriteIds.ids + (WINDOW_WIDTH * spriteTopPixel) + x;
+		SetColumnTexture(column, texture, mip, texture_x_offset, sprite_size, spriteTopPixel - spriteTopPixel_no_clamp);
+		MaskedWalls.DrawBehind(x, command.distance);
+		kernel(column);
+	}
+}
+
+// projects a sprite standing at (x, y), false when it is outside the fov,
+// command.size can still be 0 when it is too far to cover a pixel
+bool ProjectSprite(Real x, Real y, SpriteDrawCommand& command)
+{
+	Real dx = x - player.x;
+	Real dy = y - player.y;
+
+	Real distance;
+	int sprite_size;
+	int spriteLeftX;
+
+#if FIXED_POINT_MODE
+	long long angle_player_sprite = player.ViewAngle() - FineTrig.PointToAngle(dx.raw, dy.raw);
+
+	// wrap between -180 and 180
+	angle_player_sprite = FineTables<FINEANGLES>::Wrap(angle_player_sprite + FINEANGLES / 2) - FINEANGLES / 2;
+
+	if (llabs(angle_player_sprite) >= NUM_RAYS / 2)
+		return false;
+
+	distance = Fixed::FromRaw(FixedSqrt((int64_t)dx.raw * dx.raw + (int64_t)dy.raw * dy.raw));
+	sprite_size = ProjectTileHeight(distance);
+
+	fixed_t tangent = FixedDiv(FineTrig.Sin(angle_player_sprite), FineTrig.Cos(angle_player_sprite));
+	spriteLeftX = (WINDOW_WIDTH / 2) - (FixedMul(tangent, DISTANCE_PROJ_PLANE_FIXED) >> FRACBITS);
+#else
+	float angle_player_sprite = player.rotation_angle - atan2(dy, dx);
+
+	// clamp angle between 0 and 180
+	if (angle_player_sprite > PI)
+		angle_player_sprite -= 2.0f * PI;
+	if (angle_player_sprite < -PI)
+		angle_player_sprite += 2.0f * PI;
+
+	if (fabs(angle_player_sprite) >= FOV_ANGLE / 2)
+		return false;
+
+	distance = sqrtf(dx * dx + dy * dy);
+	sprite_size = ProjectTileHeight(distance);
+
+	float distance_proj_plane = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
+	spriteLeftX = (int)((WINDOW_WIDTH / 2) - tanf(angle_player_sprite) * distance_proj_plane);
+#endif
+
+	command.distance = distance;
+	command.left_x = spriteLeftX;
+	command.size = sprite_size > 0 ? sprite_size : 0;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+///////////////////////////////// DECALS ///////////////////////////
+
+
+#define MAX_DECALS 128                 // the least recently seen decal makes room for a new one
+#define DECAL_FACE_COUNT (MAP_TILE_COUNT * 4)
+#define NO_DECAL -1
+
+enum DecalKind : uint8_t
+{
+	DECAL_BULLET_HOLE,
+	DECAL_BLOOD,
+	DECAL_KIND_COUNT,
+};
+
+// size on the wall in tile units, and the texture size it is drawn from
+const uint8_t decal_sizes[DECAL_KIND_COUNT] = { 6, 20 };
+const int decal_texture_sizes[DECAL_KIND_COUNT] = { 16, 32 };
+
+Texture DecalTextures[DECAL_KIND_COUNT];
+
+// face of column i's hit as TileFace, keyed per tile like the decal lists,
+// the ray direction tells which of the two faces along the side it sees
+inline int DecalFaceOf(int face_id, Real dir_x, Real dir_y)
+{
+	int face;
+	if ((face_id & 1) == SIDE_VERTICAL)
+		face = dir_x > Real(0) ? TILE_FACE_WEST : TILE_FACE_EAST;
+	else
+		face = dir_y > Real(0) ? TILE_FACE_NORTH : TILE_FACE_SOUTH;
+	return ((face_id >> 1) << 2) | face;
+}
+
+inline int DecalFaceOf(int i)
+{
+	return DecalFaceOf(rays.face[i], rays.dir_x[i], rays.dir_y[i]);
+}
+
+// fixed pool of decals on wall faces, every face keeps a list of its own so
+// a column finds the decals it can show from the face it hit, and a list
+// from the most to the least recently seen decides which one is recycled
+// when the pool is full, so memory stays the same however long a match runs
+struct DecalPool
+{
+	int16_t face[MAX_DECALS];            // face key (tile * 4 + TileFace), NO_DECAL for free slots
+	uint8_t u[MAX_DECALS];               // left and top edge on the face, tile units
+	uint8_t v[MAX_DECALS];
+	uint8_t kind[MAX_DECALS];
+	int16_t next_on_face[MAX_DECALS];    // the face list, the free list for free slots
+	int16_t newer[MAX_DECALS];           // recently seen list
+	int16_t older[MAX_DECALS];
+
+	int16_t face_first[DECAL_FACE_COUNT];
+	int16_t newest = NO_DECAL;
+	int16_t oldest = NO_DECAL;
+	int16_t free_first = NO_DECAL;
+
+	DecalPool()
+	{
+		Init();
+	}
+
+	void Init()
+	{
+		memset(face_first, 0xFF, sizeof(face_first));
+		newest = oldest = NO_DECAL;
+		free_first = NO_DECAL;
+		for (int d = MAX_DECALS - 1; d >= 0; d--)
+		{
+			face[d] = NO_DECAL;
+			next_on_face[d] = free_first;
+			free_first = (int16_t)d;
+		}
+	}
+
+	// centered on (center_u, center_v) and kept inside the face, plain walls only
+	void Add(int face_key, int center_u, int center_v, DecalKind decal_kind)
+	{
+		int tile = face_key >> 2;
+		if (Tiles.info[tile].flags != TILE_WALL)
+			return;
+
+		int d = free_first;
+		if (d == NO_DECAL)
+		{
+			d = oldest;
+			Remove(d);
+		}
+		free_first = next_on_face[d];
+
+		int size = decal_sizes[decal_kind];
+		int left = center_u - size / 2;
+		int top = center_v - size / 2;
+		face[d] = (int16_t)face_key;
+		u[d] = (uint8_t)(left < 0 ? 0 : (left > TILE_SIZE - size ? TILE_SIZE - size : left));
+		v[d] = (uint8_t)(top < 0 ? 0 : (top > TILE_SIZE - size ? TILE_SIZE - size : top));
+		kind[d] = (uint8_t)decal_kind;
+
+		next_on_face[d] = face_first[face_key];
+		face_first[face_key] = (int16_t)d;
+		older[d] = NO_DECAL;
+		newer[d] = NO_DECAL;
+		LinkNewest(d);
+	}
+
+	void Remove(int d)
+	{
+		int16_t* link = &face_first[face[d]];
+		while (*link != d)
+			link = &next_on_face[*link];
+		*link = next_on_face[d];
+
+		Unlink(d);
+		face[d] = NO_DECAL;
+		next_on_face[d] = free_first;
+		free_first = (int16_t)d;
+	}
+
+	// an edited tile loses what was on its faces
+	void TileChanged(int r, int c)
+	{
+		int tile = r * COL_TILE_NUM + c;
+		for (int f = 0; f < 4; f++)
+		{
+			while (face_first[(tile << 2) | f] != NO_DECAL)
+				Remove(face_first[(tile << 2) | f]);
+		}
+	}
+
+	// moves a decal that was drawn to the front of the recently seen list
+	void Touch(int d)
+	{
+		if (d == newest)
+			return;
+		Unlink(d);
+		LinkNewest(d);
+	}
+
+	bool Covers(int d, int hit_u) const
+	{
+		return hit_u >= u[d] && hit_u < u[d] + decal_sizes[kind[d]];
+	}
+
+	void LinkNewest(int d)
+	{
+		older[d] = newest;
+		newer[d] = NO_DECAL;
+		if (newest != NO_DECAL)
+			newer[newest] = (int16_t)d;
+		newest = (int16_t)d;
+		if (oldest == NO_DECAL)
+			oldest = (int16_t)d;
+	}
+
+	void Unlink(int d)
+	{
+		if (newer[d] != NO_DECAL)
+			older[newer[d]] = older[d];
+		else
+			newest = older[d];
+
+		if (older[d] != NO_DECAL)
+			newer[older[d]] = newer[d];
+		else
+			oldest = newer[d];
+	}
+};
+DecalPool Decals;
+
+// bullet holes and blood splats on the pink color key, drawn from a hash so
+// every run gets the same shapes
+void BuildDecalTextures()
+{
+	for (int k = 0; k < DECAL_KIND_COUNT; k++)
+	{
+		Texture& texture = DecalTextures[k];
+		int size = decal_texture_sizes[k];
+		texture.w = size;
+		texture.h = size;
+		texture.bpp = 3;
+		texture.data = new uint8_t[size * size * 3 + MIP_SLACK]();
+
+		for (int y = 0; y < size; y++)
+		{
+			for (int x = 0; x < size; x++)
+			{
+				uint8_t* texel = texture.data + (y * size + x) * 3;
+				float dx = (x + 0.5f) / size - 0.5f;
+				float dy = (y + 0.5f) / size - 0.5f;
+				float r = sqrtf(dx * dx + dy * dy);
+				uint32_t hash = (uint32_t)(x * 73856093) ^ (uint32_t)(y * 19349663) ^ (uint32_t)(k * 83492791);
+				hash = (hash ^ (hash >> 13)) * 0x5bd1e995;
+				float noise = (float)((hash >> 8) & 0xFF) / 255.0f;
+
+				texel[0] = 255; texel[1] = 0; texel[2] = 255;
+				if (k == DECAL_BULLET_HOLE)
+				{
+					// dark hole in a ring of chipped off plaster
+					if (r < 0.22f)
+					{
+						texel[0] = 20; texel[1] = 18; texel[2] = 16;
+					}
+					else if (r < 0.4f && noise < 0.7f)
+					{
+						texel[0] = 70; texel[1] = 64; texel[2] = 58;
+					}
+				}
+				else
+				{
+					// splat that runs down the wall
+					bool drip = dy > 0.0f && fabsf(dx) < 0.06f + 0.05f * noise && ((x * 5) % 7) < 2;
+					if (r < 0.28f + 0.16f * noise || drip)
+					{
+						uint8_t red = (uint8_t)(110 + 60 * noise);
+						texel[0] = red; texel[1] = 8; texel[2] = 10;
+					}
+				}
+			}
+		}
+		texture.build_mips(true);
+	}
+}
+
+// projects decal d over the wall column i hit, the same way the wall is so it
+// sticks to it, false when it covers no pixel
+bool ProjectDecalColumn(GraphicsEngine* gfx, int i, int d, WallDrawCommand& command)
+{
+	Real corrected_distance = rays.distance[i] * column_cos[i];
+	int64_t wall_height = ProjectTileHeight(corrected_distance);
+	int64_t wall_top = (WINDOW_HEIGHT / 2) - (wall_height / 2);
+
+	int size = decal_sizes[Decals.kind[d]];
+	int64_t top = wall_top + wall_height * Decals.v[d] / TILE_SIZE;
+	int64_t height = wall_height * size / TILE_SIZE;
+	if (height <= 0)
+		return false;
+
+	int first = top < 0 ? 0 : (int)top;
+	int last = top + height > WINDOW_HEIGHT ? WINDOW_HEIGHT : (int)(top + height);
+	if (first >= last)
+		return false;
+
+	const Texture& texture = DecalTextures[Decals.kind[d]];
+	int mip = texture.select_mip((int)(height < INT32_MAX ? height : INT32_MAX));
+	int tex_x = (rays.hit_u[i] - Decals.u[d]) * (texture.w >> mip) / size;
+
+	const ColorMap& colormap = SelectColorMap(ToFloat(rays.distance[i]), rays.side[i] == SIDE_VERTICAL);
+
+	TextureColumn& column = command.column;
+	column.dst = gfx->framebuffer + (WINDOW_WIDTH * first) + i;
+	column.pitch = WINDOW_WIDTH;
+	column.count = last - first;
+	column.ramp = colormap.ramp;
+	column.scale = colormap.scale;
+	column.id_dst = SpriteIds.ids + (column.dst - gfx->framebuffer);    // never pickable
+	column.id = 0;
+	column.texels = texture.mips[mip];
+	column.tex_w = texture.w >> mip;
+	column.tex_h = texture.h >> mip;
+	column.tex_x = tex_x;
+	column.v_step = (uint32_t)(((int64_t)column.tex_h << 16) / height);
+	column.v = (uint32_t)((first - top) * column.v_step);
+
+	command.kernel = Kernels.Get(column.tex_w, column.tex_h, texture.bpp, true);
+	return true;
+}
+
+// draws the decals over the wall columns, a column whose face has none
+// costs one lookup. runs after the walls and before the masked walls and
+// sprites, which cover decals like they cover the wall
+void RenderDecals(GraphicsEngine* gfx, JobSystem* jobs, FrameArena& arena)
+{
+	int count = 0;
+	for (int i = 0; i < rays.count; i++)
+	{
+		if (rays.face[i] == -1)
+			continue;
+		for (int d = Decals.face_first[DecalFaceOf(i)]; d != NO_DECAL; d = Decals.next_on_face[d])
+			count += Decals.Covers(d, rays.hit_u[i]);
+	}
+	if (count == 0)
+		return;
+
+	WallDrawCommand* commands = arena.Alloc<WallDrawCommand>(count);
+	int* command_column = arena.Alloc<int>(count);
+	int command_count = 0;
+	for (int i = 0; i < rays.count; i++)
+	{
+		if (rays.face[i] == -1)
+			continue;
+		for (int d = Decals.face_first[DecalFaceOf(i)]; d != NO_DECAL; d = Decals.next_on_face[d])
+		{
+			if (!Decals.Covers(d, rays.hit_u[i]))
+				continue;
+			Decals.Touch(d);
+			if (ProjectDecalColumn(gfx, i, d, commands[command_count]))
+				command_column[command_count++] = i;
+		}
+	}
+
+	// decals of one column can overlap, a batch takes every column that
+	// starts in it whole so they draw in the order of the face list
+	jobs->ParallelFor(command_count, 64, [&](int begin, int end)
+	{
+		int c = begin;
+		while (c > 0 && c < command_count && command_column[c] == command_column[c - 1])
+			c++;
+		for (; c < command_count && (c < end || command_column[c] == command_column[c - 1]); c++)
+			commands[c].kernel(commands[c].column);
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+///////////////////////////////// PARTICLES ///////////////////////////
+
+
+#define MAX_PARTICLES 4096             // a multiple of 4, the update moves four at a time
+#define PARTICLE_SPAWN_RING 1024       // spawns between two updates, the rest are dropped
+#define PARTICLE_NEAR 4.0f             // closer to the eye than this they are not drawn
+
+// what an emitter asks for, plain values so it can go through the ring by copy
+struct ParticleSpawn
+{
+	float x, y, z;                                // z is the height above the floor, TILE_SIZE is the ceiling
+	float velocity_x, velocity_y, velocity_z;     // units per second
+	float gravity;                                // units per second squared down, smoke has it negative
+	float drag;                                   // part of the speed lost per second
+	float life;                                   // seconds
+	float size;                                   // units across
+	uint32_t color;                               // framebuffer format
+};
+
+// purely visual, so it runs on floats and the frame time in either number
+// mode and never feeds back into the game. game code on any thread emits
+// through the ring, the main thread takes the spawns in on Update()
+struct ParticleSystem
+{
+	alignas(16) float x[MAX_PARTICLES];
+	alignas(16) float y[MAX_PARTICLES];
+	alignas(16) float z[MAX_PARTICLES];
+	alignas(16) float velocity_x[MAX_PARTICLES];
+	alignas(16) float velocity_y[MAX_PARTICLES];
+	alignas(16) float velocity_z[MAX_PARTICLES];
+	alignas(16) float gravity[MAX_PARTICLES];
+	alignas(16) float drag[MAX_PARTICLES];
+	alignas(16) float life[MAX_PARTICLES];
+	float size[MAX_PARTICLES];
+	uint32_t color[MAX_PARTICLES];
+	int count = 0;
+
+	MpscRing<ParticleSpawn, PARTICLE_SPAWN_RING> spawns;
+
+	// from any thread, false when the ring is full and the particle was dropped
+	bool Emit(const ParticleSpawn& spawn)
+	{
+		return spawns.Push(spawn);
+	}
+
+	void Update(float dt)
+	{
+		// the ring is drained even when the pool is full, so it never backs up
+		ParticleSpawn spawn;
+		while (spawns.Pop(spawn))
+		{
+			if (count < MAX_PARTICLES)
+				Add(spawn);
+		}
+
+		Integrate(dt);
+
+		// burnt out or flown into a wall, the last one takes the place
+		for (int p = 0; p < count;)
+		{
+			int raw = (int)floorf(y[p] / TILE_SIZE);
+			int col = (int)floorf(x[p] / TILE_SIZE);
+			if (life[p] > 0.0f && !IsSolidTile(raw, col))
+				p++;
+			else
+				Move(--count, p);
+		}
+	}
+
+	// four particles per step, the lanes past count move garbage nobody reads
+	void Integrate(float dt)
+	{
+		const __m128 dt4 = _mm_set1_ps(dt);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 ceiling = _mm_set1_ps((float)TILE_SIZE);
+
+		for (int p = 0; p < count; p += 4)
+		{
+			__m128 keep = _mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(_mm_load_ps(drag + p), dt4)));
+			__m128 vx = _mm_mul_ps(_mm_load_ps(velocity_x + p), keep);
+			__m128 vy = _mm_mul_ps(_mm_load_ps(velocity_y + p), keep);
+			__m128 vz = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(velocity_z + p), keep), _mm_mul_ps(_mm_load_ps(gravity + p), dt4));
+
+			__m128 pz = _mm_add_ps(_mm_load_ps(z + p), _mm_mul_ps(vz, dt4));
+
+			// floor and ceiling stop the vertical motion, debris comes to rest
+			__m128 outside = _mm_or_ps(_mm_cmplt_ps(pz, zero), _mm_cmpgt_ps(pz, ceiling));
+			vz = _mm_andnot_ps(outside, vz);
+			pz = _mm_min_ps(_mm_max_ps(pz, zero), ceiling);
+
+			_mm_store_ps(x + p, _mm_add_ps(_mm_load_ps(x + p), _mm_mul_ps(vx, dt4)));
+			_mm_store_ps(y + p, _mm_add_ps(_mm_load_ps(y + p), _mm_mul_ps(vy, dt4)));
+			_mm_store_ps(z + p, pz);
+			_mm_store_ps(velocity_x + p, vx);
+			_mm_store_ps(velocity_y + p, vy);
+			_mm_store_ps(velocity_z + p, vz);
+			_mm_store_ps(life + p, _mm_sub_ps(_mm_load_ps(life + p), dt4));
+		}
+	}
+
+	void Add(const ParticleSpawn& spawn)
+	{
+		int p = count++;
+		x[p] = spawn.x;
+		y[p] = spawn.y;
+		z[p] = spawn.z;
+		velocity_x[p] = spawn.velocity_x;
+		velocity_y[p] = spawn.velocity_y;
+		velocity_z[p] = spawn.velocity_z;
+		gravity[p] = spawn.gravity;
+		drag[p] = spawn.drag;
+		life[p] = spawn.life;
+		size[p] = spawn.size;
+		color[p] = spawn.color;
+	}
+
+	void Move(int from, int to)
+	{
+		x[to] = x[from];
+		y[to] = y[from];
+		z[to] = z[from];
+		velocity_x[to] = velocity_x[from];
+		velocity_y[to] = velocity_y[from];
+		velocity_z[to] = velocity_z[from];
+		gravity[to] = gravity[from];
+		drag[to] = drag[from];
+		life[to] = life[from];
+		size[to] = size[from];
+		color[to] = color[from];
+	}
+};
+ParticleSystem Particles;
+
+// a particle on screen, a square of one color
+struct ParticleDraw
+{
+	float depth;
+	int left, top, size;
+	uint32_t color;
+};
+
+// projects the particles as squares facing the view, far to near, then draws
+// them column range by column range so the jobs never touch the same pixel.
+// each pixel column is tested against the wall depth of its ray, sprites and
+// grates are not in that depth so particles draw over them
+void RenderParticles(GraphicsEngine* gfx, JobSystem* jobs, FrameArena& arena)
+{
+	if (Particles.count == 0 || rays.count == 0)
+		return;
+
+	float distance_proj_plane = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
+	long long angle = player.ViewAngle();
+	float forward_x = ToFloat(AngleCos(angle));
+	float forward_y = ToFloat(AngleSin(angle));
+	float eye_x = ToFloat(player.x);
+	float eye_y = ToFloat(player.y);
+
+	ParticleDraw* draws = arena.Alloc<ParticleDraw>(Particles.count);
+	int draw_count = 0;
+	for (int p = 0; p < Particles.count; p++)
+	{
+		float to_x = Particles.x[p] - eye_x;
+		float to_y = Particles.y[p] - eye_y;
+		float depth = to_x * forward_x + to_y * forward_y;
+		if (depth < PARTICLE_NEAR)
+			continue;
+
+		float across = to_x * -forward_y + to_y * forward_x;
+		float scale = distance_proj_plane / depth;
+		int size = (int)(Particles.size[p] * scale);
+		size = size < 1 ? 1 : size;
+
+		ParticleDraw& draw = draws[draw_count];
+		draw.depth = depth;
+		draw.size = size;
+		draw.left = (int)((WINDOW_WIDTH / 2) + across * scale) - size / 2;
+		draw.top = (int)((WINDOW_HEIGHT / 2) + ((TILE_SIZE / 2) - Particles.z[p]) * scale) - size / 2;
+		if (draw.left >= WINDOW_WIDTH || draw.left + size <= 0 || draw.top >= WINDOW_HEIGHT || draw.top + size <= 0)
+			continue;
+
+		uint32_t c = Particles.color[p];
+		const ColorMap& colormap = SelectColorMap(depth, false);
+		draw.color = gfx->RGBtoUint(colormap.ramp[c >> 24], colormap.ramp[(c >> 16) & 0xFF], colormap.ramp[(c >> 8) & 0xFF], c & 0xFF);
+		draw_count++;
+	}
+	if (draw_count == 0)
+		return;
+
+	std::sort(draws, draws + draw_count, [](const ParticleDraw& a, const ParticleDraw& b) { return a.depth > b.depth; });
+
+	// depth along the view direction, the same measure as the particles'
+	float* wall_depth = arena.Alloc<float>(rays.count);
+	for (int i = 0; i < rays.count; i++)
+		wall_depth[i] = ToFloat(rays.distance[i] * column_cos[i]);
+
+	jobs->ParallelFor(rays.count, 64, [&](int begin, int end)
+	{
+		for (int d = 0; d < draw_count; d++)
+		{
+			const ParticleDraw& draw = draws[d];
+			int first_x = draw.left > begin ? draw.left : begin;
+			int last_x = draw.left + draw.size < end ? draw.left + draw.size : end;
+			int first_y = draw.top > 0 ? draw.top : 0;
+			int last_y = draw.top + draw.size < WINDOW_HEIGHT ? draw.top + draw.size : WINDOW_HEIGHT;
+
+			for (int px = first_x; px < last_x; px++)
+			{
+				if (!(draw.depth < wall_depth[px]))
+					continue;
+				uint32_t* dst = gfx->framebuffer + (WINDOW_WIDTH * first_y) + px;
+				for (int py = first_y; py < last_y; py++, dst += WINDOW_WIDTH)
+					*dst = draw.color;
+			}
+		}
+	});
+}
+
+inline float RandomUnit()
+{
+	return (float)rand() / (float)RAND_MAX;
+}
+
+// a short burst of flame in front of the gun
+void EmitMuzzleFlash()
+{
+	long long angle = player.ViewAngle();
+	float forward_x = ToFloat(AngleCos(angle));
+	float forward_y = ToFloat(AngleSin(angle));
+
+	for (int k = 0; k < 6; k++)
+	{
+		ParticleSpawn spawn;
+		spawn.x = ToFloat(player.x) + forward_x * 24.0f;
+		spawn.y = ToFloat(player.y) + forward_y * 24.0f;
+		spawn.z = (TILE_SIZE / 2) - 4.0f;
+		spawn.velocity_x = forward_x * (60.0f + 60.0f * RandomUnit()) + (RandomUnit() - 0.5f) * 30.0f;
+		spawn.velocity_y = forward_y * (60.0f + 60.0f * RandomUnit()) + (RandomUnit() - 0.5f) * 30.0f;
+		spawn.velocity_z = (RandomUnit() - 0.5f) * 30.0f;
+		spawn.gravity = 0.0f;
+		spawn.drag = 4.0f;
+		spawn.life = 0.05f + 0.05f * RandomUnit();
+		spawn.size = 0.2f;
+		spawn.color = RandomUnit() < 0.5f ? 0xFFE060FF : 0xFFA020FF;
+		Particles.Emit(spawn);
+	}
+}
+
+// chips and a puff of dust where a shot hits a wall, or a spray of blood,
+// (x, y) is on the surface and (normal_x, normal_y) points away from it
+void EmitImpact(float x, float y, float z, float normal_x, float normal_y, bool blood)
+{
+	int pieces = blood ? 24 : 12;
+	for (int k = 0; k < pieces; k++)
+	{
+		ParticleSpawn spawn;
+		float speed = 40.0f + 80.0f * RandomUnit();
+		spawn.x = x + normal_x * 2.0f;
+		spawn.y = y + normal_y * 2.0f;
+		spawn.z = z;
+		spawn.velocity_x = normal_x * speed + (RandomUnit() - 0.5f) * 80.0f;
+		spawn.velocity_y = normal_y * speed + (RandomUnit() - 0.5f) * 80.0f;
+		spawn.velocity_z = 20.0f + 60.0f * RandomUnit();
+		spawn.gravity = 240.0f;
+		spawn.drag = 1.5f;
+		spawn.life = 0.6f + 0.6f * RandomUnit();
+		spawn.size = blood ? 0.8f : 0.6f;
+		uint8_t shade = (uint8_t)(90 + 60 * RandomUnit());
+		spawn.color = blood ? ((uint32_t)(120 + 80 * RandomUnit()) << 24) | 0xFF : ((uint32_t)shade << 24) | ((uint32_t)shade << 16) | ((uint32_t)shade << 8) | 0xFF;
+		Particles.Emit(spawn);
+	}
+
+	if (blood)
+		return;
+
+	for (int k = 0; k < 4; k++)
+	{
+		ParticleSpawn spawn;
+		spawn.x = x + normal_x * 3.0f;
+		spawn.y = y + normal_y * 3.0f;
+		spawn.z = z;
+		spawn.velocity_x = normal_x * 15.0f + (RandomUnit() - 0.5f) * 10.0f;
+		spawn.velocity_y = normal_y * 15.0f + (RandomUnit() - 0.5f) * 10.0f;
+		spawn.velocity_z = 5.0f;
+		spawn.gravity = -12.0f;
+		spawn.drag = 2.0f;
+		spawn.life = 0.8f + 0.6f * RandomUnit();
+		spawn.size = 2.5f + 2.0f * RandomUnit();
+		spawn.color = 0xB4B0A8FF;
+		Particles.Emit(spawn);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+///////////////////////////////// FLOW FIELD ///////////////////////////
+
+
+#define FLOW_UNREACHABLE 0xFFFF
+#define FLOW_TILES_PER_UPDATE 1024    // tiles the rebuild may visit per update, bounds its cost on big maps
+
+// one map wide path to the player shared by every guard, tile distances from
+// a breadth first search out of the player's tile plus the direction a guard
+// standing in each tile walks, following it is a lookup no matter how many
+// guards there are
+struct FlowGrid
+{
+	uint16_t distance[RAW_TILE_NUM][COL_TILE_NUM];   // steps to the target, FLOW_UNREACHABLE for walls and closed off tiles
+	Real dir_x[RAW_TILE_NUM][COL_TILE_NUM];          // unit direction to the closest neighbour, 0 at the target
+	Real dir_y[RAW_TILE_NUM][COL_TILE_NUM];
+};
+
+// walls and door frames, a diagonal step may not clip either so doors are
+// always walked through straight
+inline bool BlocksCorner(int raw, int col)
+{
+	return IsWallTile(raw, col) || Doors.At(raw, col) != -1;
+}
+
+// rebuilt only when the player changes tile, into a back grid a budget of
+// tiles at a time, guards keep following the front grid until the new one
+// is done and the two swap
+struct FlowField
+{
+	FlowGrid grids[2];
+	FlowGrid* front = &grids[0];
+	FlowGrid* back = &grids[1];
+	bool ready = false;               // front holds a finished grid
+
+	int target_raw = -1;              // tile the back grid is built for
+	int target_col = -1;
+	bool building = false;
+
+	uint16_t queue[RAW_TILE_NUM * COL_TILE_NUM];
+	int queue_head = 0;
+	int queue_tail = 0;
+	int gradient_next = 0;            // tiles whose direction is set, after the search finished
+
+	void StartBuild(int raw, int col)
+	{
+		target_raw = raw;
+		target_col = col;
+		building = true;
+
+		for (int r = 0; r < RAW_TILE_NUM; r++)
+			for (int c = 0; c < COL_TILE_NUM; c++)
+				back->distance[r][c] = FLOW_UNREACHABLE;
+
+		back->distance[raw][col] = 0;
+		queue[0] = (uint16_t)(raw * COL_TILE_NUM + col);
+		queue_head = 0;
+		queue_tail = 1;
+		gradient_next = 0;
+	}
+
+	// picks the neighbour with the smallest distance, diagonals only when
+	// both tiles next to the corner are open so guards don't clip it
+	static void SetGradient(FlowGrid& grid, int raw, int col)
+	{
+		static const Real diagonal = ToReal(0.70710678118654752);
+
+		grid.dir_x[raw][col] = Real(0);
+		grid.dir_y[raw][col] = Real(0);
+
+		uint16_t best = grid.distance[raw][col];
+		if (best == 0 || best == FLOW_UNREACHABLE)
+			return;
+
+		for (int dr = -1; dr <= 1; dr++)
+		{
+			for (int dc = -1; dc <= 1; dc++)
+			{
+				if ((dr == 0 && dc == 0) || IsWallTile(raw + dr, col + dc))
+					continue;
+				if (dr != 0 && dc != 0 && (BlocksCorner(raw + dr, col) || BlocksCorner(raw, col + dc) || BlocksCorner(raw + dr, col + dc) || BlocksCorner(raw, col)))
+					continue;
+
+				uint16_t neighbour = grid.distance[raw + dr][col + dc];
+				if (neighbour >= best)
+					continue;
+
+				best = neighbour;
+				Real length = dr != 0 && dc != 0 ? diagonal : Real(1);
+				grid.dir_x[raw][col] = dc > 0 ? length : (dc < 0 ? -length : Real(0));
+				grid.dir_y[raw][col] = dr > 0 ? length : (dr < 0 ? -length : Real(0));
+			}
+		}
+	}
+
+	// continues the current rebuild for at most budget tiles, true once it finished
+	bool ContinueBuild(int budget)
+	{
+		static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+		while (queue_head < queue_tail && budget > 0)
+		{
+			int tile = queue[queue_head++];
+			int raw = tile / COL_TILE_NUM;
+			int col = tile % COL_TILE_NUM;
+			uint16_t next_distance = back->distance[raw][col] + 1;
+			budget--;
+
+			for (int n = 0; n < 4; n++)
+			{
+				int r = raw + offsets[n][0];
+				int c = col + offsets[n][1];
+				if (IsWallTile(r, c) || back->distance[r][c] != FLOW_UNREACHABLE)
+					continue;
+
+				back->distance[r][c] = next_distance;
+				queue[queue_tail++] = (uint16_t)(r * COL_TILE_NUM + c);
+			}
+		}
+
+		while (queue_head == queue_tail && gradient_next < RAW_TILE_NUM * COL_TILE_NUM && budget > 0)
+		{
+			SetGradient(*back, gradient_next / COL_TILE_NUM, gradient_next % COL_TILE_NUM);
+			gradient_next++;
+			budget--;
+		}
+
+		return queue_head == queue_tail && gradient_next == RAW_TILE_NUM * COL_TILE_NUM;
+	}
+
+	void Update(const Player& target)
+	{
+		int raw = FloorToInt(target.y) / TILE_SIZE;
+		int col = FloorToInt(target.x) / TILE_SIZE;
+
+		// a new tile restarts the rebuild, the front grid still leads to the old one
+		if (raw != target_raw || col != target_col)
+			StartBuild(raw, col);
+
+		if (!building)
+			return;
+
+		if (ContinueBuild(FLOW_TILES_PER_UPDATE))
+		{
+			FlowGrid* built = back;
+			back = front;
+			front = built;
+			building = false;
+			ready = true;
+		}
+	}
+
+	// an opened tile can only make paths shorter, and only those through it,
+	// so the front grid is fixed in place by spreading the shorter distances
+	// out of the tile. a closed tile can make paths longer anywhere, it is
+	// cut out of the front grid and a rebuild starts, guards route around it
+	// on the old paths meanwhile
+	void TileChanged(int raw, int col)
+	{
+		static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+		if (!ready)
+		{
+			// the first build may have gone past the tile already
+			if (building)
+				StartBuild(target_raw, target_col);
+			return;
+		}
+
+		FlowGrid& grid = *front;
+		int changed = 0;
+		if (IsWallTile(raw, col))
+		{
+			grid.distance[raw][col] = FLOW_UNREACHABLE;
+			StartBuild(target_raw, target_col);
+		}
+		else
+		{
+			// the build queue is free, a running build starts over below
+			uint16_t best = FLOW_UNREACHABLE;
+			for (int n = 0; n < 4; n++)
+			{
+				int r = raw + offsets[n][0];
+				int c = col + offsets[n][1];
+				if (!IsWallTile(r, c) && grid.distance[r][c] < best)
+					best = grid.distance[r][c];
+			}
+
+			if (best != FLOW_UNREACHABLE)
+			{
+				grid.distance[raw][col] = best + 1;
+				queue[changed++] = (uint16_t)(raw * COL_TILE_NUM + col);
+			}
+
+			for (int i = 0; i < changed; i++)
+			{
+				int r = queue[i] / COL_TILE_NUM;
+				int c = queue[i] % COL_TILE_NUM;
+				uint16_t next_distance = grid.distance[r][c] + 1;
+				for (int n = 0; n < 4; n++)
+				{
+					int nr = r + offsets[n][0];
+					int nc = c + offsets[n][1];
+					if (IsWallTile(nr, nc) || grid.distance[nr][nc] <= next_distance)
+						continue;
+
+					grid.distance[nr][nc] = next_distance;
+					queue[changed++] = (uint16_t)(nr * COL_TILE_NUM + nc);
+				}
+			}
+		}
+
+		// directions change next to every tile whose distance did, and
+		// diagonals past the edited tile may open or close
+		SetGradients(grid, raw, col);
+		for (int i = 0; i < changed; i++)
+			SetGradients(grid, queue[i] / COL_TILE_NUM, queue[i] % COL_TILE_NUM);
+
+		if (building && !IsWallTile(raw, col))
+			StartBuild(target_raw, target_col);
+	}
+
+	// the tile and its eight neighbours
+	static void SetGradients(FlowGrid& grid, int raw, int col)
+	{
+		for (int r = raw - 1; r <= raw + 1; r++)
+			for (int c = col - 1; c <= col + 1; c++)
+				if (r >= 0 && c >= 0 && r < RAW_TILE_NUM && c < COL_TILE_NUM)
+					SetGradient(grid, r, c);
+	}
+
+	uint16_t DistanceAt(Real x, Real y) const
+	{
+		return front->distance[FloorToInt(y) / TILE_SIZE][FloorToInt(x) / TILE_SIZE];
+	}
+};
+FlowField Flow;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+///////////////////////////////// ENTITIES ///////////////////////////
+
+
+#define MAX_ENTITIES 8192
+#define ENTITY_UPDATE_BATCH 256
+#define ENTITY_MAP_SIZE 10
+#define GUARD_HEALTH 25
+#define ENTITY_FRAME_TIME ToReal(0.125)   // seconds per animation frame
+#define SPAWN_GUARDS_COUNT 1000           // guards added by F2
+#define GUARD_SPEED ToReal(96)            // units per second
+#define GUARD_HEAR_DISTANCE 2             // guards this many steps away notice the player without seeing them
+#define GUARD_STOP_DISTANCE 1             // and stop once they are this close
+#define GUARD_RADIUS 16                   // collision circle
+
+static_assert(MAX_ENTITIES <= (1 << SPRITE_ID_SLOT_BITS), "entity slots must fit in a sprite id");
+
+enum EntityKind : uint8_t
+{
+	ENTITY_GUARD,
+};
+
+enum AiState : uint8_t
+{
+	AI_IDLE,
+	AI_CHASE,     // follows the flow field to the player
+	AI_DEAD,      // removed after the update pass
+};
+
+// entities bucketed by the tile they stand in, rebuilt at the start of every
+// update by a counting sort so each bucket is a contiguous run of one array,
+// positions are copied in so jobs can read their neighbours while those move
+struct EntityGrid
+{
+	int32_t tile_start[MAP_TILE_COUNT + 1];   // bucket of tile t is [tile_start[t], tile_start[t + 1])
+	int32_t tile_cursor[MAP_TILE_COUNT];
+	int32_t entity_tile[MAX_ENTITIES];
+
+	// entries in bucket order
+	int32_t entity[MAX_ENTITIES];
+	Real x[MAX_ENTITIES];
+	Real y[MAX_ENTITIES];
+
+	// raw * COL_TILE_NUM + col, positions off the map go to the nearest edge tile
+	static int TileAt(Real at_x, Real at_y)
+	{
+		int raw = FloorToInt(at_y) / TILE_SIZE;
+		int col = FloorToInt(at_x) / TILE_SIZE;
+		raw = raw < 0 ? 0 : (raw >= RAW_TILE_NUM ? RAW_TILE_NUM - 1 : raw);
+		col = col < 0 ? 0 : (col >= COL_TILE_NUM ? COL_TILE_NUM - 1 : col);
+		return raw * COL_TILE_NUM + col;
+	}
+
+	void Build(const Real* entity_x, const Real* entity_y, int count)
+	{
+		memset(tile_start, 0, sizeof(tile_start));
+		for (int i = 0; i < count; i++)
+		{
+			entity_tile[i] = TileAt(entity_x[i], entity_y[i]);
+			tile_start[entity_tile[i] + 1]++;
+		}
+
+		for (int t = 0; t < MAP_TILE_COUNT; t++)
+		{
+			tile_start[t + 1] += tile_start[t];
+			tile_cursor[t] = tile_start[t];
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			int k = tile_cursor[entity_tile[i]]++;
+			entity[k] = i;
+			x[k] = entity_x[i];
+			y[k] = entity_y[i];
+		}
+	}
+
+	// func(entity, x, y) for everything standing in one of the tiles, a run
+	// of tiles in the set is one run of entries so it is walked in one go
+	template <typename F>
+	void ForEachInTiles(const TileSet& tiles, F&& func) const
+	{
+		int tile = 0;
+		while (tile < MAP_TILE_COUNT)
+		{
+			uint64_t word = tiles.bits[tile >> 6] >> (tile & 63);
+			if (word == 0)
+			{
+				// nothing left in this word
+				tile = (tile | 63) + 1;
+				continue;
+			}
+			if (!(word & 1))
+			{
+				tile++;
+				continue;
+			}
+
+			int first = tile;
+			while (tile < MAP_TILE_COUNT && tiles.Has(tile))
+				tile++;
+			for (int k = tile_start[first]; k < tile_start[tile]; k++)
+				func(entity[k], x[k], y[k]);
 		}
 	}
 
-	void Render(GraphicsEngine* gfx)
+	// func(entity, x, y) for everything closer than radius, which stays under
+	// two tiles so squared distances fit in 16.16
+	template <typename F>
+	void ForEachNear(Real at_x, Real at_y, Real radius, F&& func) const
 	{
-		gfx-> DrawCircle(
-			x * MAP_SCALING_FACTOR,
-			y * MAP_SCALING_FACTOR,
-			size * MAP_SCALING_FACTOR,
-			RED_COLOR);
+		int first = TileAt(at_x - radius, at_y - radius);
+		int last = TileAt(at_x + radius, at_y + radius);
+		int first_col = first % COL_TILE_NUM;
+		int last_col = last % COL_TILE_NUM;
 
-		gfx->DrawLine(
-			x * MAP_SCALING_FACTOR,
-			y * MAP_SCALING_FACTOR,
-			(x + cosf(rotation_angle) * 100.0f ) * MAP_SCALING_FACTOR,
-			(y + sinf(rotation_angle) * 100.0f ) * MAP_SCALING_FACTOR,
-			RED_COLOR);
+		for (int raw = first / COL_TILE_NUM; raw <= last / COL_TILE_NUM; raw++)
+		{
+			for (int k = tile_start[raw * COL_TILE_NUM + first_col]; k < tile_start[raw * COL_TILE_NUM + last_col + 1]; k++)
+			{
+				Real dx = x[k] - at_x;
+				Real dy = y[k] - at_y;
+				if (!(Abs(dx) < radius) || !(Abs(dy) < radius) || !(dx * dx + dy * dy < radius * radius))
+					continue;
+				func(entity[k], x[k], y[k]);
+			}
+		}
 	}
 };
-Player player;
-
-/////////////////////////////////////////////////////////////////
-
-
-
-//////////////////////////// RAY CASTING ////////////////////////
-
+EntityGrid Grid;
 
-struct IntersectionData
+// refers to an entity through its slot, the generation makes handles to a
+// destroyed entity stop resolving even after the slot was reused
+struct EntityHandle
 {
-	bool hit;
-	float x, y;
+	uint32_t slot = 0;
+	uint32_t generation = 0;    // slots start at generation 1, a default handle is never valid
 };
 
-IntersectionData RayToLineIntersection(
-	float rx, float ry, float rdx, float rdy,
-	float x1, float y1, float x2, float y2)
+// every component is a dense array indexed by entity, [0, count) are alive
+// and destroying moves the last entity into the hole, so the update and
+// render passes walk plain arrays without gaps or per entity pointers
+struct EntityStore
 {
-	IntersectionData result{ false, 0.0f, 0.0f };
-
-	float sdx = x2 - x1;
-	float sdy = y2 - y1;
+	int count = 0;
+
+	// transform
+	Real x[MAX_ENTITIES];
+	Real y[MAX_ENTITIES];
+	Real move_x[MAX_ENTITIES];        // wanted this update, resolved against the walls in one pass
+	Real move_y[MAX_ENTITIES];
+
+	// sprite, entities without a texture only show on the minimap
+	const Texture* texture[MAX_ENTITIES];
+	bool in_view[MAX_ENTITIES];       // inside the fov when the frame was drawn
+
+	// health
+	int16_t health[MAX_ENTITIES];
+
+	// ai
+	EntityKind kind[MAX_ENTITIES];
+	AiState ai_state[MAX_ENTITIES];
+	int32_t sight_query[MAX_ENTITIES];   // line of sight to the player asked this update, -1 for none
+
+	// animation, frames sit left to right in the texture
+	uint8_t frame[MAX_ENTITIES];
+	uint8_t frame_count[MAX_ENTITIES];
+	Real frame_time[MAX_ENTITIES];    // seconds spent on the current frame
+
+	// handles, slot_generation is bumped whenever a slot is taken or freed
+	uint32_t entity_slot[MAX_ENTITIES];
+	uint32_t slot_entity[MAX_ENTITIES];
+	uint32_t slot_generation[MAX_ENTITIES];
+	uint32_t free_slots[MAX_ENTITIES];
+	int free_count = 0;
+	uint32_t unused_slot = 0;         // slots from here on were never handed out
+
+	EntityHandle Create(EntityKind entity_kind, Real spawn_x, Real spawn_y, const Texture* sprite_texture)
+	{
+		EntityHandle handle;
+		if (count >= MAX_ENTITIES)
+			return handle;
+
+		uint32_t slot = free_count > 0 ? free_slots[--free_count] : unused_slot++;
+		int i = count++;
+
+		x[i] = spawn_x;
+		y[i] = spawn_y;
+		texture[i] = sprite_texture;
+		in_view[i] = false;
+		health[i] = entity_kind == ENTITY_GUARD ? GUARD_HEALTH : 1;
+		kind[i] = entity_kind;
+		ai_state[i] = AI_IDLE;
+		sight_query[i] = -1;
+		frame[i] = 0;
+		frame_count[i] = 1;
+		frame_time[i] = Real(0);
+
+		entity_slot[i] = slot;
+		slot_entity[slot] = i;
+		slot_generation[slot]++;
+
+		handle.slot = slot;
+		handle.generation = slot_generation[slot];
+		return handle;
+	}
 
-	float denom = rdx * sdy - rdy * sdx;
+	// dense index of the entity, -1 once it was destroyed
+	int Find(EntityHandle handle) const
+	{
+		if (handle.slot >= unused_slot || slot_generation[handle.slot] != handle.generation)
+			return -1;
+		return (int)slot_entity[handle.slot];
+	}
 
-	if (fabs(denom) < 1e-6f)
+	void Destroy(EntityHandle handle)
 	{
-		return result;
+		int i = Find(handle);
+		if (i != -1)
+			DestroyAt(i);
 	}
 
-	float dx = x1 - rx;
-	float dy = y1 - ry;
+	void DestroyAt(int i)
+	{
+		uint32_t slot = entity_slot[i];
+		slot_generation[slot]++;
+		free_slots[free_count++] = slot;
 
-	float t = (dx * sdy - dy * sdx) / denom;
+		int last = --count;
+		if (i != last)
+		{
+			x[i] = x[last];
+			y[i] = y[last];
+			texture[i] = texture[last];
+			in_view[i] = in_view[last];
+			health[i] = health[last];
+			kind[i] = kind[last];
+			ai_state[i] = ai_state[last];
+			sight_query[i] = sight_query[last];
+			frame[i] = frame[last];
+			frame_count[i] = frame_count[last];
+			frame_time[i] = frame_time[last];
+
+			entity_slot[i] = entity_slot[last];
+			slot_entity[entity_slot[i]] = i;
+		}
+	}
 
-	if (t >= 0.0f)
+	// death is handled by the next update, a hurt guard starts chasing
+	void Damage(int i, int amount)
 	{
-		result.hit = true;
-		result.x = rx + t * rdx;
-		result.y = ry + t * rdy;
+		health[i] = (int16_t)(health[i] - amount);
+		if (kind[i] == ENTITY_GUARD && ai_state[i] == AI_IDLE)
+			ai_state[i] = AI_CHASE;
 	}
 
-	return result;
-}
-
-inline float Distance(float x1, float y1, float x2, float y2)
-{
-	float dx = x2 - x1;
-	float dy = y2 - y1;
-	return std::sqrt(dx * dx + dy * dy);
-}
-
-inline float NormalizeAngle(float angle)
-{
-	angle = fmodf(angle, 2.0f * PI);   // wrap within [-2π, 2π]
-	if (angle < 0)
-		angle += 2.0f * PI;            // shift to [0, 2π)
-	return angle;
-}
+	// pushes overlapping guards apart, the neighbours come from the grid so
+	// their positions are the ones from before this update started moving them
+	void SeparateGuard(int i, Real dt)
+	{
+		const Real reach = Real(2 * GUARD_RADIUS);
+		Real step = GUARD_SPEED * dt;
 
-struct Ray
-{
-	float x, y;
-	float rotation_angle = PI / 2.0f;
+		Grid.ForEachNear(x[i], y[i], reach, [&](int other, Real other_x, Real other_y)
+		{
+			if (other == i || kind[other] != ENTITY_GUARD)
+				return;
 
-	bool isRayFacingDown = 0;
-	bool isRayFacingUp = 0;
-	bool isRayFacingRight = 0;
-	bool isRayFacingLeft = 0;
+			Real dx = x[i] - other_x;
+			Real dy = y[i] - other_y;
+			Real distance = Sqrt(dx * dx + dy * dy);
+			if (!(Real(0) < distance))
+			{
+				// same spot, the lower index steps aside diagonally so a wall on one axis cannot pin both
+				dx = dy = Real(other < i ? 1 : -1);
+				distance = Sqrt(Real(2));
+			}
 
-	float min_intersection_dist = INFINITY;
-	float intersection_x = 0.0f;
-	float intersection_y = 0.0f;
-	int wall_texture_index = 1;
+			// each of the pair moves half the overlap, no faster than walking
+			Real push = (reach - distance) / Real(2);
+			push = step < push ? step : push;
+			move_x[i] += dx * push / distance;
+			move_y[i] += dy * push / distance;
+		});
+	}
 
-	bool was_vertical_hit = false;
+	void UpdateGuard(int i, Real dt, const SightBatch& sight)
+	{
+		int raw = FloorToInt(y[i]) / TILE_SIZE;
+		int col = FloorToInt(x[i]) / TILE_SIZE;
+		uint16_t steps = Flow.front->distance[raw][col];
+
+		if (ai_state[i] == AI_IDLE && (sight.IsVisible(sight_query[i]) || steps <= GUARD_HEAR_DISTANCE))
+			ai_state[i] = AI_CHASE;
+
+		if (ai_state[i] != AI_CHASE || steps <= GUARD_STOP_DISTANCE)
+			return;
+
+		// heads for the center of the next tile on the path instead of going
+		// straight along the gradient, so guards line up with a gap before
+		// they reach it and their circle does not catch on its corners
+		Real dir_x = Flow.front->dir_x[raw][col];
+		Real dir_y = Flow.front->dir_y[raw][col];
+		int next_col = col + (Real(0) < dir_x ? 1 : (dir_x < Real(0) ? -1 : 0));
+		int next_raw = raw + (Real(0) < dir_y ? 1 : (dir_y < Real(0) ? -1 : 0));
+		Real to_x = Real(next_col * TILE_SIZE + TILE_SIZE / 2) - x[i];
+		Real to_y = Real(next_raw * TILE_SIZE + TILE_SIZE / 2) - y[i];
+		Real length = Sqrt(to_x * to_x + to_y * to_y);
+		if (!(Real(0) < length))
+			return;
+
+		Real step = GUARD_SPEED * dt;
+		move_x[i] = to_x * step / length;
+		move_y[i] = to_y * step / length;
+	}
 
-	void Cast()
+	// only touches entity i, so ranges can run on different threads
+	void UpdateRange(int begin, int end, Real dt, const SightBatch& sight)
 	{
-		min_intersection_dist = INFINITY;
+		for (int i = begin; i < end; i++)
+		{
+			move_x[i] = Real(0);
+			move_y[i] = Real(0);
 
-		float normalized_angle = NormalizeAngle(rotation_angle);
-		isRayFacingDown = normalized_angle > 0 && normalized_angle < PI;
-		isRayFacingUp = !isRayFacingDown;
+			if (kind[i] == ENTITY_GUARD && Flow.ready)
+				UpdateGuard(i, dt, sight);
 
-		isRayFacingRight = normalized_angle < 0.5 * PI || normalized_angle > 1.5 * PI;
-		isRayFacingLeft = !isRayFacingRight;
+			if (kind[i] == ENTITY_GUARD)
+				SeparateGuard(i, dt);
 
-		// horizontal intersections
-		for (size_t i = 1; i < RAW_TILE_NUM; i++)
-		{
-			auto hit = RayToLineIntersection(
-				x, y,
-				cosf(rotation_angle),
-				sinf(rotation_angle),
-				0.0f, TILE_SIZE * i, WINDOW_WIDTH, TILE_SIZE * i);
+			if (health[i] <= 0)
+				ai_state[i] = AI_DEAD;
 
-			if (hit.hit)
+			if (frame_count[i] > 1)
 			{
-				int col = floor(hit.x / TILE_SIZE);
-				int raw = i;
-
-				if (isRayFacingUp)
-					raw = i - 1;
-
-				if (raw >= 0 && col >= 0 && raw < RAW_TILE_NUM && col < COL_TILE_NUM)
+				frame_time[i] += dt;
+				while (frame_time[i] >= ENTITY_FRAME_TIME)
 				{
-					if (map[raw][col] != 0)
-					{
-						float dist = Distance(x, y, hit.x, hit.y);
-						if (min_intersection_dist > dist)
-						{
-							min_intersection_dist = dist;
-							intersection_x = hit.x;
-							intersection_y = hit.y;
-							was_vertical_hit = false;
-							wall_texture_index = map[raw][col];
-						}
-					}
+					frame_time[i] -= ENTITY_FRAME_TIME;
+					frame[i] = (uint8_t)((frame[i] + 1) % frame_count[i]);
 				}
 			}
 		}
 
-		// vertical intersections
-		for (size_t i = 1; i < COL_TILE_NUM; i++)
-		{
-			auto hit = RayToLineIntersection(
-				x, y,
-				cosf(rotation_angle),
-				sinf(rotation_angle),
-				TILE_SIZE * i, 0.0f, TILE_SIZE * i, WINDOW_HEIGHT);
+		// guards are the only movers that collide, the rest have no move
+		SlideCircles(x + begin, y + begin, move_x + begin, move_y + begin, end - begin, Real(GUARD_RADIUS));
+	}
 
-			if (hit.hit)
-			{
-				int raw = floor(hit.y / TILE_SIZE);
-				int col = i;
+	void Update(Real dt, JobSystem* jobs, SightBatch& sight)
+	{
+		Grid.Build(x, y, count);
 
-				if (isRayFacingLeft)
-					col = i - 1;
+		// idle guards look for the player, all of them answered in one batch,
+		// guards outside the player's pvs cannot see him and skip the ray
+		TileSet player_pvs;
+		Pvs.Row(EntityGrid::TileAt(player.x, player.y), player_pvs);
 
-				if (raw >= 0 && col >= 0 && raw < RAW_TILE_NUM && col < COL_TILE_NUM)
-				{
-					if (map[raw][col] != 0)
-					{
-						float dist = Distance(x, y, hit.x, hit.y);
-						if (min_intersection_dist > dist)
-						{
-							min_intersection_dist = dist;
-							intersection_x = hit.x;
-							intersection_y = hit.y;
-							was_vertical_hit = true;
-							wall_texture_index = map[raw][col];
-						}
-					}
-				}
-			}
+		sight.Clear();
+		for (int i = 0; i < count; i++)
+		{
+			bool looking = kind[i] == ENTITY_GUARD && ai_state[i] == AI_IDLE && player_pvs.Has(Grid.entity_tile[i]);
+			sight_query[i] = looking ? sight.Add(x[i], y[i], player.x, player.y) : -1;
+		}
+		sight.Resolve(jobs);
+
+		jobs->ParallelFor(count, ENTITY_UPDATE_BATCH, [&](int begin, int end)
+		{
+			UpdateRange(begin, end, dt, sight);
+		});
+
+		// destroying moves entities around, so it waits for the parallel pass,
+		// going backwards every entity moved into a hole was already checked
+		for (int i = count - 1; i >= 0; i--)
+		{
+			if (ai_state[i] == AI_DEAD)
+				DestroyAt(i);
 		}
 	}
 
-	void Render(GraphicsEngine* gfx)
+	void RenderMap(GraphicsEngine* gfx)
 	{
-		gfx->DrawLine(
-			x * MAP_SCALING_FACTOR,
-			y * MAP_SCALING_FACTOR,
-			intersection_x * MAP_SCALING_FACTOR,
-			intersection_y * MAP_SCALING_FACTOR,
-			BLUE_COLOR);
+		for (int i = 0; i < count; i++)
+		{
+			gfx->DrawCircle(
+				ToFloat(x[i]) * MAP_SCALING_FACTOR,
+				ToFloat(y[i]) * MAP_SCALING_FACTOR,
+				ENTITY_MAP_SIZE * MAP_SCALING_FACTOR,
+				in_view[i] ? YELLOW_COLOR : GRAY_COLOR);
+		}
 	}
 };
-Ray rays[NUM_RAYS];
-
-/////////////////////////////////////////////////////////////////
+EntityStore Entities;
 
-struct Texture
+// stress test, fills random empty tiles with guards
+void SpawnGuards(int guard_count)
 {
-	int w, h, bpp = 0;
-	uint8_t* data = nullptr;
-
-	void load(const char* path)
+	for (int n = 0; n < guard_count; n++)
 	{
-		data = (uint8_t*)stbi_load(path, &w, &h, &bpp, 0);
-	}
+		int raw, col;
+		do
+		{
+			raw = GameRandom.Below(RAW_TILE_NUM);
+			col = GameRandom.Below(COL_TILE_NUM);
+		} while (Tiles.IsFilled(raw, col));
 
-	void free()
-	{
-		stbi_image_free(data);
-		w = h = bpp = 0;
+		Real spawn_x = Real(col * TILE_SIZE + GUARD_RADIUS + GameRandom.Below(TILE_SIZE - 2 * GUARD_RADIUS));
+		Real spawn_y = Real(raw * TILE_SIZE + GUARD_RADIUS + GameRandom.Below(TILE_SIZE - 2 * GUARD_RADIUS));
+		Entities.Create(ENTITY_GUARD, spawn_x, spawn_y, &GuardTexture);
 	}
-};
-Texture WallTextures[8];
-Texture GuardTexture;
-
+}
 
-void Render3DProjectWalls(GraphicsEngine* gfx)
+// tiles whose sprites can be on screen, the visited ones and the neighbours of
+// visited open tiles, since a sprite is a tile wide it sticks out of its own
+TileSet SpriteTiles(const TileSet& visited)
 {
-	for (int i = 0; i < NUM_RAYS; i++)
+	TileSet tiles;
+	tiles.Clear();
+	for (int raw = 0; raw < RAW_TILE_NUM; raw++)
 	{
-		float ray_distance = rays[i].min_intersection_dist;
-		float corrected_distance = ray_distance * cosf(rays[i].rotation_angle - player.rotation_angle);
-		float distance_proj_plane = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
-		float projected_wall_height = (TILE_SIZE / corrected_distance) * distance_proj_plane;
+		for (int col = 0; col < COL_TILE_NUM; col++)
+		{
+			if (!visited.Has(raw * COL_TILE_NUM + col) || IsSolidTile(raw, col))
+				continue;
 
-		int wallStripHeight = (int)projected_wall_height;
+			for (int r = raw - 1; r <= raw + 1; r++)
+				for (int c = col - 1; c <= col + 1; c++)
+					if (r >= 0 && c >= 0 && r < RAW_TILE_NUM && c < COL_TILE_NUM)
+						tiles.Set(r * COL_TILE_NUM + c);
+		}
+	}
+	return tiles;
+}
 
-		int wallTopPixel = (WINDOW_HEIGHT / 2) - (wallStripHeight / 2);
-		int wallTopPixel_no_clamp = wallTopPixel;
-		wallTopPixel = wallTopPixel < 0 ? 0 : wallTopPixel;
+// the visible list, sort keys and draw commands all live in the frame arena,
+// only the grid buckets of tiles whose sprites can be on screen are walked,
+// so entities on tiles no ray reached are never looked at. the grid is the
+// one UpdateDoors() built after the entities moved and were destroyed
+void RenderSprites(GraphicsEngine* gfx, FrameArena& arena, EntityStore& entities)
+{
+	SpriteDrawCommand* commands = arena.Alloc<SpriteDrawCommand>(entities.count);
+	uint64_t* sort_keys = arena.Alloc<uint64_t>(entities.count);
+	int visible_count = 0;
 
-		int wallBottomPixel = (WINDOW_HEIGHT / 2) + (wallStripHeight / 2);
-		wallBottomPixel = wallBottomPixel > WINDOW_HEIGHT ? WINDOW_HEIGHT : wallBottomPixel;
+	TileSet tiles = SpriteTiles(rays.visited);
+	memset(entities.in_view, 0, sizeof(bool) * entities.count);
 
-		// ceiling
-		for (int y = 0; y < wallTopPixel; y++)
-		{
-			gfx->framebuffer[(WINDOW_WIDTH * y) + i] = 0x333333FF;
-		}
+	Grid.ForEachInTiles(tiles, [&](int i, Real x, Real y)
+	{
+		SpriteDrawCommand& command = commands[visible_count];
+		entities.in_view[i] = ProjectSprite(x, y, command);
+		if (!entities.in_view[i] || command.size == 0 || !entities.texture[i])
+			return;
+
+		command.texture = entities.texture[i];
+		command.frame = entities.frame[i];
+		command.frame_count = entities.frame_count[i];
+		command.slot = entities.entity_slot[i];
+		command.generation = entities.slot_generation[command.slot];
+		sort_keys[visible_count] = ((uint64_t)DepthKey(command.distance) << 32) | (uint32_t)visible_count;
+		visible_count++;
+	});
+
+	// far to near
+	std::sort(sort_keys, sort_keys + visible_count, std::greater<uint64_t>());
+
+	SpriteIds.NextFrame();
+
+	for (int i = 0; i < visible_count; i++)
+		DrawSprite(gfx, commands[(uint32_t)sort_keys[i]]);
+}
 
-		// walls
-		int textureOffsetX;
-		if (rays[i].was_vertical_hit)
-			textureOffsetX = (int)rays[i].intersection_y % TILE_SIZE;
-		else
-			textureOffsetX = (int)rays[i].intersection_x % TILE_SIZE;
+////////////////////////////////////////////////////////////////////////////////////////////
 
-		for (int y = wallTopPixel; y < wallBottomPixel; y++)
-		{
-			auto WallTexture = WallTextures[rays[i].wall_texture_index];
 
-			int textureOffsetY = (y - wallTopPixel_no_clamp) * ((float)WallTexture.h / wallStripHeight);
+///////////////////////////////// DOORS ///////////////////////////
 
-			int index = ((WallTexture.w * textureOffsetY) + textureOffsetX) * 4;
 
-			uint8_t r = WallTexture.data[index + 0];
-			uint8_t g = WallTexture.data[index + 1];
-			uint8_t b = WallTexture.data[index + 2];
-			uint8_t a = WallTexture.data[index + 3];
-			
-			gfx->framebuffer[(WINDOW_WIDTH * y) + i] = gfx->RGBtoUint(r, g, b, a);
+#define DOOR_USE_REACH 64     // how far ahead the player can open a door
 
-			//gfx->framebuffer[(WINDOW_WIDTH * y) + i] = rays[i].was_vertical_hit ? 0xCCCCCCFF : 0xFFFFFFFF;
-		}
-	}
+// whether a circle reaches into the tile
+bool CircleInTile(int raw, int col, Real x, Real y, Real radius)
+{
+	const Real half_tile = Real(TILE_SIZE / 2);
+	Real gap_x = Abs(x - Real(col * TILE_SIZE + TILE_SIZE / 2)) - half_tile;
+	Real gap_y = Abs(y - Real(raw * TILE_SIZE + TILE_SIZE / 2)) - half_tile;
+	gap_x = gap_x < Real(0) ? Real(0) : gap_x;
+	gap_y = gap_y < Real(0) ? Real(0) : gap_y;
+	return gap_x < radius && gap_y < radius && gap_x * gap_x + gap_y * gap_y < radius * radius;
 }
 
-///////////////////////////////////////////////////////////////////
-
-struct PlayerSpriteSheet
+bool CircleInDoor(int d, Real x, Real y, Real radius)
 {
-	int w, h, bpp = 0;
-	int frame_width = 0;
-	int frame_count = 0;
-	int frames_per_sprite = 0;
-	uint8_t* data = nullptr;
-
-	int frame_counter = 0;
-	int current_frame = 0;
-	bool animation_finished = true;
-	bool is_playing = false;
+	return CircleInTile(Doors.raw[d], Doors.col[d], x, y, radius);
+}
 
-	void load(const char* path, int framewidth, int framecount, int framespersprite)
-	{
-		data = (uint8_t*)stbi_load(path, &w, &h, &bpp, 0);
-		frame_width = framewidth;
-		frame_count = framecount;
-		frames_per_sprite = framespersprite;
-	}
+// chasing guards open the doors they come up to, and a door does not close
+// on the player or an entity, runs after the entities moved and destroyed
+// theirs so the grid is built again from where they are now
+void UpdateDoors(Real dt)
+{
+	Grid.Build(Entities.x, Entities.y, Entities.count);
 
-	void free()
+	bool occupied[MAX_DOORS];
+	for (int d = 0; d < Doors.count; d++)
 	{
-		stbi_image_free(data);
-		w = h = bpp = 0;
-		frame_width = 0;
-		frame_count = 0;
-
-		frame_counter = 0;
-		current_frame = 0;
-		animation_finished = true;
-		is_playing = false;
-	}
+		Real center_x = Real(Doors.col[d] * TILE_SIZE + TILE_SIZE / 2);
+		Real center_y = Real(Doors.raw[d] * TILE_SIZE + TILE_SIZE / 2);
 
-	void PlayAnimation()
-	{
-		frame_counter = 0;
-		current_frame = 0;
-		is_playing = true;
-	}
+		occupied[d] = CircleInDoor(d, player.x, player.y, ToReal(player.size));
 
-	void Update()
-	{
-		if (is_playing)
+		bool chased = false;
+		Grid.ForEachNear(center_x, center_y, Real(TILE_SIZE), [&](int i, Real entity_x, Real entity_y)
 		{
-			frame_counter++;
-			int frame_index = frame_counter / frames_per_sprite;
+			occupied[d] |= CircleInDoor(d, entity_x, entity_y, Real(GUARD_RADIUS));
+			chased |= Entities.kind[i] == ENTITY_GUARD && Entities.ai_state[i] == AI_CHASE;
+		});
 
-			if (frame_index >= frame_count) // exceeded the frame count in sprite sheet
-			{
-				current_frame = 0;
-				animation_finished = true;
-				is_playing = false;
-			}
-			else
-			{
-				current_frame = frame_index;
-				animation_finished = false;
-			}
-		}
+		if (chased)
+			Doors.Open(d);
 	}
 
-	void Render(GraphicsEngine* gfx)
-	{
-		int rect_w = frame_width;
-		int rect_h = h;
-		int start_x = WINDOW_WIDTH * 0.5f - rect_w * 0.5f;
-		int start_y = WINDOW_HEIGHT - rect_h;
-
-		int image_x = current_frame * frame_width;
-		int image_y = 0;
+	Doors.Update(dt, occupied);
+}
 
-		for (size_t y = start_y; y < start_y + rect_h; y++)
+// opens the first door straight ahead of the player within reach
+void UseDoor()
+{
+	long long angle = player.ViewAngle();
+	for (int reach = TILE_SIZE / 4; reach <= DOOR_USE_REACH; reach += TILE_SIZE / 4)
+	{
+		Real probe_x = player.x + AngleCos(angle) * Real(reach);
+		Real probe_y = player.y + AngleSin(angle) * Real(reach);
+		int door = Doors.At(FloorToInt(probe_y) / TILE_SIZE, FloorToInt(probe_x) / TILE_SIZE);
+		if (door != -1)
 		{
-			for (size_t x = start_x; x < start_x + rect_w; x++)
-			{
-				int src_index = ((w * image_y) + image_x) * 4;
-
-				uint8_t r = data[src_index + 0];
-				uint8_t g = data[src_index + 1];
-				uint8_t b = data[src_index + 2];
-				uint8_t a = data[src_index + 3];
-
-				if (a > 10)
-					gfx->framebuffer[(WINDOW_WIDTH * y) + x] = gfx->RGBtoUint(r, g, b, a);
-				image_x++;
-			}
-			image_x = current_frame * frame_width;
-			image_y++;
+			Doors.Open(door);
+			return;
 		}
 	}
-};
-PlayerSpriteSheet PlayerGunSpriteSheet;
-
-///////////////////////////////// Sprite (Enemy, Doors, ... etc) ///////////////////////////
+}
 
-struct Sprite
-{
-	int x = WINDOW_WIDTH * 0.5f;
-	int y = WINDOW_HEIGHT * 0.5f;
-	int map_size = 10;
-	bool visible = false;
-	COLOR map_color = GRAY_COLOR;
+////////////////////////////////////////////////////////////////////////////////////////////
 
-	void Render(GraphicsEngine* gfx)
-	{
-		float dx = x - player.x;
-		float dy = y - player.y;
 
-		float angle_player_sprite = player.rotation_angle - atan2(dy, dx);
+///////////////////////////////// MAP EDITS ///////////////////////////
 
-		// clamp angle between 0 and 180
-		if (angle_player_sprite > PI)
-			angle_player_sprite -= 2.0f * PI;
-		if (angle_player_sprite < -PI)
-			angle_player_sprite += 2.0f * PI;
 
-		visible = false;
-		map_color = GRAY_COLOR;
+// changes a tile while the game runs (pushwalls, destructible walls, secret
+// areas), everything built from the map only redoes the part around the
+// tile, the pvs and the flow field spread what is left over their updates.
+// the border stays solid so nothing walks or looks out of the map
+void SetTile(int raw, int col, int value)
+{
+	if (raw <= 0 || col <= 0 || raw >= RAW_TILE_NUM - 1 || col >= COL_TILE_NUM - 1 || map[raw][col] == value)
+		return;
+
+	map[raw][col] = value;
+	TileEdits++;
+
+	Tiles.TileChanged(raw, col);
+	Doors.TileChanged(raw, col);
+	Pvs.TileChanged(raw, col);
+	Flow.TileChanged(raw, col);
+	Clearance.TileChanged(raw, col);
+	Decals.TileChanged(raw, col);
+}
 
-		if (fabs(angle_player_sprite) < FOV_ANGLE / 2)
-		{
-			map_color = YELLOW_COLOR;
+// F3 knocks out the wall in the middle of the view, F4 puts one on the open
+// tile ahead of the player, for trying out map edits
+void KnockOutWallAhead()
+{
+	if (rays.count == 0)
+		return;
 
-			visible = true;
-			float distance = sqrtf(dx * dx + dy * dy);
+	int face = rays.face[rays.count / 2];
+	if (face == -1)
+		return;
 
-			float distance_proj_plane = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
+	int tile = face >> 1;
+	if (IsWallTile(tile / COL_TILE_NUM, tile % COL_TILE_NUM))
+		SetTile(tile / COL_TILE_NUM, tile % COL_TILE_NUM, 0);
+}
 
-			float sprite_h = (TILE_SIZE / distance) * distance_proj_plane;
-			float sprite_w = sprite_h;
+// a wall is not put where it would close on the player or a guard, the
+// collision only keeps movers out of walls and can't push them back out
+void BuildWallAhead()
+{
+	long long angle = player.ViewAngle();
+	int raw = FloorToInt(player.y + AngleSin(angle) * Real(TILE_SIZE)) / TILE_SIZE;
+	int col = FloorToInt(player.x + AngleCos(angle) * Real(TILE_SIZE)) / TILE_SIZE;
+	if (map[raw][col] != 0 || CircleInTile(raw, col, player.x, player.y, ToReal(player.size)))
+		return;
+
+	// guards spawned since the last update are not in the grid yet
+	Grid.Build(Entities.x, Entities.y, Entities.count);
+
+	bool occupied = false;
+	Real center_x = Real(col * TILE_SIZE + TILE_SIZE / 2);
+	Real center_y = Real(raw * TILE_SIZE + TILE_SIZE / 2);
+	Grid.ForEachNear(center_x, center_y, Real(TILE_SIZE + GUARD_RADIUS), [&](int, Real entity_x, Real entity_y)
+	{
+		occupied |= CircleInTile(raw, col, entity_x, entity_y, Real(GUARD_RADIUS));
+	});
 
-			int spriteTopPixel = (WINDOW_HEIGHT / 2) - (sprite_h / 2);
-			int spriteTopPixel_no_clamp = spriteTopPixel;
-			spriteTopPixel = spriteTopPixel < 0 ? 0 : spriteTopPixel;
+	if (!occupied)
+		SetTile(raw, col, 1);
+}
 
-			int spriteBottomPixel = (WINDOW_HEIGHT / 2) + (sprite_h / 2);
-			spriteBottomPixel = spriteBottomPixel > WINDOW_HEIGHT ? WINDOW_HEIGHT : spriteBottomPixel;
+////////////////////////////////////////////////////////////////////////////////////////////
 
-			float spriteScreenPosX = tanf(angle_player_sprite) * distance_proj_plane;
 
-			float spriteLeftX = (WINDOW_WIDTH / 2) - spriteScreenPosX;
+///////////////////////////////// HITSCAN ///////////////////////////
 
-			float spriteRightX = spriteLeftX + sprite_w;
 
-			for (int x = spriteLeftX; x < spriteRightX; x++)
-			{
-				int texture_x_offset = (x - spriteLeftX) * ((float)GuardTexture.w / sprite_w);
+#define PISTOL_DAMAGE 10
+#define BLOOD_REACH 96                 // walls further behind someone shot stay clean
+#define BULLET_SPREAD 4                // tile units the holes scatter around the aim point
 
-				for (size_t y = spriteTopPixel; y < spriteBottomPixel; y++)
-				{
-					if (x > 0 && y > 0 && x < WINDOW_WIDTH && y < WINDOW_HEIGHT)
-					{
-						int texture_y_offset = (y - spriteTopPixel_no_clamp) * ((float)GuardTexture.h / sprite_h);
+// what a shot through a pixel hits
+struct HitscanResult
+{
+	EntityHandle target;  // entity hit, as it was when the frame was drawn
+	int entity = -1;      // and its dense index now, -1 when the shot went past every sprite or it is gone
+	int face = -1;        // FaceId of the wall behind the pixel, -1 when the ray left the map
+	int decal_face = -1;  // and the face of its tile the ray hit, for DecalPool
+	Real wall_distance;
+	int hit_u = 0;
+	Real dir_x, dir_y;    // direction of the ray through the pixel
+};
 
-						int src_index = ((GuardTexture.w * texture_y_offset) + texture_x_offset) * 4;
+// reads the last frame back instead of tracing, sprites were depth tested
+// against the column when drawn so a sprite id always wins over the wall,
+// and a shot costs two lookups however many are fired
+HitscanResult ResolveHitscan(int screen_x, int screen_y, const EntityStore& entities)
+{
+	HitscanResult result;
+	if (rays.count == 0)
+		return result;
 
-						uint8_t r = GuardTexture.data[src_index + 0];
-						uint8_t g = GuardTexture.data[src_index + 1];
-						uint8_t b = GuardTexture.data[src_index + 2];
-						uint8_t a = GuardTexture.data[src_index + 3];
+	int slot = SpriteIds.SlotAt(screen_x, screen_y);
+	if (slot != -1)
+	{
+		result.target.slot = (uint32_t)slot;
+		result.target.generation = SpriteIds.generation[slot];
+		result.entity = entities.Find(result.target);
+	}
 
-						uint32_t color = gfx->RGBtoUint(r, g, b, a);
+	result.face = rays.face[screen_x];
+	result.decal_face = result.face != -1 ? DecalFaceOf(screen_x) : -1;
+	result.wall_distance = rays.distance[screen_x];
+	result.hit_u = rays.hit_u[screen_x];
+	result.dir_x = rays.dir_x[screen_x];
+	result.dir_y = rays.dir_y[screen_x];
+	return result;
+}
 
-						bool is_pink = color == 0xFF00FFFF;
-						if(!is_pink && distance < rays[x].min_intersection_dist)
-							gfx->framebuffer[(WINDOW_WIDTH * y) + x] = color;
-					}
-				}
-			}
+#if FIXED_POINT_MODE
+// what the last frame drew comes out of float culling and depends on the
+// frame timing, so in fixed point mode a shot is cast on the grid from the
+// simulation state alone like a column of the view, and hits the nearest
+// entity whose collision circle the ray passes through before the wall
+HitscanResult TraceHitscan(FrameArena& arena, const EntityStore& entities)
+{
+	RayBuffers ray;
+	ray.Allocate(arena, 1);
+	ray.SetAngle(0, player.ViewAngle());
+	ray.Cast(0, player.x, player.y);
+
+	HitscanResult result;
+	result.face = ray.face[0];
+	result.decal_face = result.face != -1 ? DecalFaceOf(result.face, ray.dir_x[0], ray.dir_y[0]) : -1;
+	result.wall_distance = ray.distance[0];
+	result.hit_u = ray.hit_u[0];
+	result.dir_x = ray.dir_x[0];
+	result.dir_y = ray.dir_y[0];
+
+	Real nearest = ray.distance[0];
+	for (int i = 0; i < entities.count; i++)
+	{
+		if (!entities.texture[i])
+			continue;
+
+		Real dx = entities.x[i] - player.x;
+		Real dy = entities.y[i] - player.y;
+		Real along = dx * result.dir_x + dy * result.dir_y;
+		Real across = Abs(dx * result.dir_y - dy * result.dir_x);
+		if (Real(0) < along && along < nearest && across < Real(GUARD_RADIUS))
+		{
+			nearest = along;
+			result.entity = i;
 		}
 	}
 
-	void RenderMapSprite(GraphicsEngine* gfx)
+	if (result.entity != -1)
 	{
-		gfx->DrawCircle(
-			x * MAP_SCALING_FACTOR,
-			y * MAP_SCALING_FACTOR,
-			map_size * MAP_SCALING_FACTOR, map_color);
+		result.target.slot = entities.entity_slot[result.entity];
+		result.target.generation = entities.slot_generation[result.target.slot];
 	}
-};
-Sprite Enemy;
+	return result;
+}
+#endif
+
+void FirePlayerWeapon(FrameArena& arena)
+{
+#if FIXED_POINT_MODE
+	HitscanResult shot = TraceHitscan(arena, Entities);
+#else
+	// rays have not changed since the frame on screen was drawn, and an
+	// entity destroyed since is not hit even when its slot was reused
+	HitscanResult shot = ResolveHitscan(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2, Entities);
+	(void)arena;    // only the fixed point trace allocates
+#endif
+	int spread_u = GameRandom.Below(2 * BULLET_SPREAD + 1) - BULLET_SPREAD;
+	int spread_v = GameRandom.Below(2 * BULLET_SPREAD + 1) - BULLET_SPREAD;
+	float ray_x = ToFloat(shot.dir_x);
+	float ray_y = ToFloat(shot.dir_y);
+
+	EmitMuzzleFlash();
+
+	if (shot.entity != -1)
+	{
+		// blood on the wall right behind, read before the damage can remove the
+		// entity, both distances are along the center ray
+		Real dx = Entities.x[shot.entity] - player.x;
+		Real dy = Entities.y[shot.entity] - player.y;
+		Real behind = shot.wall_distance - (dx * shot.dir_x + dy * shot.dir_y);
+		if (shot.face != -1 && behind < Real(BLOOD_REACH))
+			Decals.Add(shot.decal_face, shot.hit_u + spread_u, TILE_SIZE / 2 + spread_v, DECAL_BLOOD);
+
+		EmitImpact(ToFloat(Entities.x[shot.entity]), ToFloat(Entities.y[shot.entity]), TILE_SIZE / 2, ray_x, ray_y, true);
+		Entities.Damage(shot.entity, PISTOL_DAMAGE);
+	}
+	else if (shot.face != -1)
+	{
+		Decals.Add(shot.decal_face, shot.hit_u + spread_u, TILE_SIZE / 2 + spread_v, DECAL_BULLET_HOLE);
+
+		// the chips fly back off the face the ray hit
+		float distance = ToFloat(shot.wall_distance);
+		bool vertical = (shot.face & 1) == SIDE_VERTICAL;
+		float normal_x = vertical ? (ray_x > 0.0f ? -1.0f : 1.0f) : 0.0f;
+		float normal_y = vertical ? 0.0f : (ray_y > 0.0f ? -1.0f : 1.0f);
+		EmitImpact(ToFloat(player.x) + ray_x * distance, ToFloat(player.y) + ray_y * distance, (float)(TILE_SIZE / 2 - spread_v), normal_x, normal_y, false);
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -591,6 +4327,18 @@ int main(int argc, char** argv)
 	}
 
 	GraphicsEngine* GFX = new GraphicsEngine(window, WINDOW_WIDTH, WINDOW_HEIGHT);
+	JobSystem* Jobs = new JobSystem();
+	FrameArena* FrameArenas[2] = { new FrameArena(FRAME_ARENA_SIZE), new FrameArena(FRAME_ARENA_SIZE) };
+	uint64_t frame_index = 0;
+
+	Kernels.Init();
+	BuildColorMaps();
+	BuildColumnCosines();
+	BuildColumnTangents();
+	Tiles.Build();
+	Doors.Init();
+	Clearance.Build();
+	Pvs.Build();
 
 	float mouse_x = 0.0f;
 	float mouse_y = 0.0f;
@@ -610,6 +4358,25 @@ int main(int argc, char** argv)
 
 	GuardTexture.load("assets/guard.png");
 
+	for (int i = 1; i < 8; i++)
+		WallTextures[i].build_mips(false);
+	GuardTexture.build_mips(true);
+	BuildGrateTexture(WallTextures[GRATE_TILE]);
+	BuildTorchTexture(WallTextures[6]);
+	WallAnimations.Init();
+	BuildDecalTextures();
+
+	Entities.Create(ENTITY_GUARD, Real(WINDOW_WIDTH / 2), Real(WINDOW_HEIGHT / 2), &GuardTexture);
+
+	FloorTexture.build(WallTextures[FLOOR_TEXTURE_INDEX]);
+	CeilingTexture.build(WallTextures[CEILING_TEXTURE_INDEX]);
+
+	// time from here on, loading doesn't count as a frame or as tics to catch up on
+	lastTime = SDL_GetTicks();
+#if FIXED_POINT_MODE
+	uint64_t simulated_tics = lastTime * TICRATE / 1000;
+#endif
+
 	SDL_Event e;
 	bool is_game_running = true;
 	while (is_game_running)
@@ -618,6 +4385,10 @@ int main(int argc, char** argv)
 		deltaTime = ((double)currentTime - (double)lastTime) / 1000.0;
 		lastTime = currentTime;
 
+		// transient data of this frame, last frame's arena stays intact for the ray cache
+		FrameArena& frame_arena = *FrameArenas[frame_index++ & 1];
+		frame_arena.Reset();
+
 		//std::cout << "fps " << 1.0 / deltaTime << "\n";
 
 		while (SDL_PollEvent(&e))
@@ -639,6 +4410,24 @@ int main(int argc, char** argv)
 					player.turn_direction = +1;
 				if (e.key.key == SDLK_A)
 					player.turn_direction = -1;
+				if (e.key.key == SDLK_SPACE)
+					UseDoor();
+				if (e.key.key == SDLK_F1)
+				{
+					adaptive_ray_subsampling = !adaptive_ray_subsampling;
+					ray_cache.valid = false;
+				}
+				if (e.key.key == SDLK_F2)
+					SpawnGuards(SPAWN_GUARDS_COUNT);
+				if (e.key.key == SDLK_F3)
+					KnockOutWallAhead();
+				if (e.key.key == SDLK_F4)
+					BuildWallAhead();
+				if (e.key.key == SDLK_F5)
+				{
+					clearance_skipping = !clearance_skipping;
+					ray_cache.valid = false;
+				}
 			}
 			break;
 			case SDL_EVENT_KEY_UP:
@@ -666,6 +4455,7 @@ int main(int argc, char** argv)
 				{
 					PlayerGunSpriteSheet.PlayAnimation();
 					PlaySound(TEXT("assets/gun shoot.wav"), NULL, SND_ASYNC | SND_FILENAME);
+					FirePlayerWeapon(frame_arena);
 				}
 			}
 			break;
@@ -674,44 +4464,74 @@ int main(int argc, char** argv)
 			}
 		}
 
+		Sight.Begin(frame_arena, Entities.count);
+
 		// update
+#if FIXED_POINT_MODE
+		// whole tics only, the simulation never sees the frame time
+		uint64_t target_tics = currentTime * TICRATE / 1000;
+		if (target_tics - simulated_tics > MAX_TICS_PER_FRAME)
+			simulated_tics = target_tics - MAX_TICS_PER_FRAME;
+		while (simulated_tics < target_tics)
+		{
+			player.UpdateTic();
+			Flow.Update(player);
+			Pvs.Update();
+			Entities.Update(Fixed::FromRaw(FRACUNIT / TICRATE), Jobs, Sight);
+			UpdateDoors(Fixed::FromRaw(FRACUNIT / TICRATE));
+			simulated_tics++;
+		}
+#else
 		player.Update(deltaTime);
+		Flow.Update(player);
+		Pvs.Update();
+		Entities.Update(deltaTime, Jobs, Sight);
+		UpdateDoors(deltaTime);
+#endif
 		PlayerGunSpriteSheet.Update();
+		WallAnimations.Update(currentTime);
+		Particles.Update((float)deltaTime);
+
+		// cast all rays
+		ray_cache.Update(player, frame_arena);
 
 		// render
 		GFX->Clear(BLACK_COLOR);
 
-		GFX->ClearFramebuffer(DARK_GRAY_COLOR);
-		Render3DProjectWalls(GFX);
-		Enemy.Render(GFX);
+		RenderFloorAndCeiling(GFX, Jobs);
+		Render3DProjectWalls(GFX, Jobs, frame_arena);
+		RenderDecals(GFX, Jobs, frame_arena);
+		MaskedWalls.Build(GFX, frame_arena);
+		RenderSprites(GFX, frame_arena, Entities);
+		MaskedWalls.DrawRest(Jobs);
+		RenderParticles(GFX, Jobs, frame_arena);
 		PlayerGunSpriteSheet.Render(GFX);
 		GFX->DrawFramebuffer();
 
 		RenderMap(GFX);
 		player.Render(GFX);
 
-		// cast all rays
-		{
-			float rayAngle = player.rotation_angle - (FOV_ANGLE / 2.0f);
-
-			for (int stripId = 0; stripId < NUM_RAYS; stripId++)
-			{
-				rays[stripId].x = player.x;
-				rays[stripId].y = player.y;
-				rays[stripId].rotation_angle = rayAngle;
-
-				rays[stripId].Cast();
-				rays[stripId].Render(GFX);
-
-				rayAngle += FOV_ANGLE / NUM_RAYS;
-			}
-		}
-		Enemy.RenderMapSprite(GFX);
+		rays.Render(GFX, ray_cache.origin_x, ray_cache.origin_y);
+		Entities.RenderMap(GFX);
 
 		GFX->Present();
 	}
 
 	PlayerGunSpriteSheet.free();
+	for (int i = 1; i < WALL_IMAGE_COUNT; i++)
+		WallTextures[i].free();
+	GuardTexture.free();
+	for (Texture& texture : DecalTextures)
+		texture.free();
+	FloorTexture.free();
+	CeilingTexture.free();
+	for (FrameArena* arena : FrameArenas)
+	{
+		arena->Destroy();
+		delete arena;
+	}
+	Jobs->Destroy();
+	delete Jobs;
 	GFX->Destroy();
 	delete GFX;
 	SDL_DestroyWindow(window);